@@ -0,0 +1,1173 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <optional>
+#include <immintrin.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+#include "BmpFormat.h"
+#include "KernelTuning.h"
+#include "LatencyMetrics.h"
+#include "ThreadPool.h"
+
+using std::unique_ptr;
+
+// Size of the last level cache in bytes, may be overridden with ALPHABLEND_LLC_SIZE environment variable
+size_t detectCacheSize() {
+    const char *overridden = getenv("ALPHABLEND_LLC_SIZE");
+
+    if (overridden)
+        return strtoull(overridden, nullptr, 10);
+
+    long size = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if (size <= 0)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+
+    if (size <= 0)
+        size = 8 << 20;                  // Reasonable guess for desktop processors
+
+    return size;
+}
+
+// Pixel buffers are 32-byte aligned for AVX2, aligned_alloc wants size to be multiple of alignment
+unsigned char *allocatePixels(size_t size) {
+    void *pixels = aligned_alloc(32, (size + 31) & ~static_cast<size_t>(31));
+
+    if (!pixels)
+        throw std::bad_alloc();
+
+    return static_cast<unsigned char *>(pixels);
+}
+
+unsigned char *mapPixels(size_t size) {
+    void *pixels = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (pixels == MAP_FAILED)
+        throw std::bad_alloc();
+
+    return static_cast<unsigned char *>(pixels);
+}
+
+void unmapPixels(void *pixels, size_t size) {
+    munmap(pixels, size);
+}
+
+template<typename T>
+void bufWrite(const unique_ptr<unsigned char[]> &out, T value, size_t &offset) {
+    memcpy(out.get() + offset, &value, sizeof(T));
+    offset += sizeof(T);
+}
+
+class bufferWriter {
+private:
+    const unique_ptr<unsigned char[]> &out;
+    size_t offset;
+public:
+    bufferWriter(const unique_ptr<unsigned char[]> &out) : out(out), offset(0) {}
+
+    ~bufferWriter() = default;
+
+    template<typename T>
+    void operator()(T value) {
+        bufWrite(out, value, offset);
+    }
+};
+
+template<typename T>
+void parseValue(T &to, const unique_ptr<unsigned char[]> &arr, size_t &offset) {
+    to = *reinterpret_cast<T *>(arr.get() + offset);
+    offset += sizeof(T);
+}
+
+class parserWrapper {
+private:
+    size_t &offset;
+    const unique_ptr<unsigned char[]> &arr;
+
+public:
+    template<typename T>
+    void operator()(T &dst) {
+        parseValue(dst, arr, offset);
+    }
+
+    parserWrapper(size_t &offset, const unique_ptr<unsigned char[]> &arr) : offset(offset), arr(arr) {}
+
+    ~parserWrapper() = default;
+};
+
+std::atomic<size_t> BitMapImage::streamingThreshold{SIZE_MAX};  // Off, streaming measured slower than cached stores
+std::atomic<bool> BitMapImage::fixedSizeSprites{true};
+std::atomic<uint64_t> BitMapImage::nextIdentity{0};
+
+void BitMapImage::deepCopy(const BitMapImage &other) {
+    MarkModified();
+    fileSize = other.fileSize;
+    offBits = other.offBits;
+    structSize = other.structSize;
+    width = other.width;
+    height = other.height;
+    planes = other.planes;
+    bitCount = other.bitCount;
+    compression = other.compression;
+    imageSize = other.imageSize;
+    Xppm = other.Xppm;
+    Yppm = other.Yppm;
+    clrUsed = other.clrUsed;
+    clrImportant = other.clrImportant;
+    redMask = other.redMask;
+    greenMask = other.greenMask;
+    blueMask = other.blueMask;
+    alphaMask = other.alphaMask;
+    CSType = other.CSType;
+    format = other.format;
+
+    size_t size = static_cast<size_t>(width) * height * BytesPerPixel(format);
+    image = unique_ptr<unsigned char[], free_deleter>(allocatePixels(size));     // Also forgets mapped pixels
+    memcpy(image.get(), other.image.get(), size);
+}
+
+
+BitMapImage::BitMapImage(BitMapImage &&other) noexcept {
+    std::swap(*this, other);
+}
+
+BitMapImage &BitMapImage::operator=(BitMapImage &&other) {
+    std::swap(*this, other);
+    return *this;
+}
+
+static unique_ptr<FILE, int (*)(FILE *)> openForReading(const char *filename) {
+    unique_ptr<FILE, int (*)(FILE *)> input(fopen(filename, "rb"), &fclose);
+
+    if (!input)
+        throw std::runtime_error("Cannot open file");
+
+    return input;
+}
+
+// File stays open until the delegated constructor is done, temporaries live to the end of the initializer
+BitMapImage::BitMapImage(const char *filename, PixelFormat format)
+        : BitMapImage(openForReading(filename).get(), format) {}
+
+BitMapImage::BitMapImage(FILE *input, PixelFormat format) {
+    LatencyMetrics::Timer timer(LatencyMetrics::Load);
+    unique_ptr<unsigned char[]> bitmapFileHeader = std::make_unique<unsigned char[]>(
+            BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE);
+
+    if (fseek(input, 0, SEEK_SET) != 0)
+        throw std::runtime_error("Cannot read file");
+
+    // Read file header with BMP V4 Image header
+    size_t headerRead = fread(bitmapFileHeader.get(), sizeof(unsigned char),
+                              BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE, input);
+
+    if (headerRead >= 4 && !memcmp(bitmapFileHeader.get(), "qoif", 4)) {
+        loadQoi(input);
+        ConvertTo(format);
+        return;
+    }
+
+    size_t offset = 0;
+
+    unsigned short signature = 0;
+
+    auto fileHeaderParser = parserWrapper(offset, bitmapFileHeader);
+
+    fileHeaderParser(signature);
+
+    if (signature == 0x424d)
+        throw std::runtime_error("Big-endian format is not yet supported");
+
+    if (signature != BMP_SIGNATURE)
+        throw std::runtime_error("Invalid file signature");
+
+    if (headerRead < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE)
+        throw std::runtime_error("BMP header is truncated");
+
+    fileHeaderParser(fileSize);
+
+    offset += 4;
+
+    fileHeaderParser(offBits);           // Read offset to the beginning of the image
+    fileHeaderParser(structSize);       // Read structure size
+    fileHeaderParser(width);                 // Read image width
+    fileHeaderParser(height);           // Read image height
+    fileHeaderParser(planes);           // Read number of planes
+
+    if (planes != 1)
+        throw std::runtime_error("Invalid number of planes (Must be 1)");
+
+    fileHeaderParser(bitCount);         // Read depth of image
+
+    if (bitCount <= 8 && structSize >= BMP_INFO_HEADER_SIZE) {
+        fileHeaderParser(compression);  // Fields up to color table size are the same in every info header
+        fileHeaderParser(imageSize);
+        fileHeaderParser(Xppm);
+        fileHeaderParser(Yppm);
+        fileHeaderParser(clrUsed);
+
+        loadIndexed(input);
+        ConvertTo(format);
+        return;
+    }
+
+    if (structSize < BMP_V4_HEADER_SIZE || headerRead < BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE)
+        throw std::runtime_error("Only BMP v4 and BMP v5 are supported");
+
+    if (height < 0)
+        throw std::runtime_error("Top-down 32-bit images are not supported");
+
+    // Same limit as other decoders, so that header cannot ask for gigabytes of memory
+    if (width <= 0 || height == 0 || static_cast<size_t>(width) * height > (static_cast<size_t>(1) << 30))
+        throw std::runtime_error("Invalid image size");
+
+    if (bitCount != 32)
+        throw std::runtime_error("Only 32-bit pixels are supported");
+
+    fileHeaderParser(compression);      // Read compression type
+
+    if (compression != 6 && compression != 3)
+        throw std::runtime_error("Only images with bitmask are supported");
+
+    fileHeaderParser(imageSize);        // Read image size
+
+    if (imageSize != static_cast<size_t>(width) * height * 4)
+        throw std::runtime_error("Image size does not match width and height");
+
+    fileHeaderParser(Xppm);             // Read PPM for X axis
+    fileHeaderParser(Yppm);             // Read PPM for Y axis
+
+    fileHeaderParser(clrUsed);          // Read size of color table
+
+    if (clrUsed != 0)
+        throw std::runtime_error("Color table is not supported");
+
+    fileHeaderParser(clrImportant);     // Number of important colors in table
+
+    fileHeaderParser(redMask);          // Mask for red channel
+    fileHeaderParser(greenMask);        // Mask for green chanel
+    fileHeaderParser(blueMask);         // Mask for blue channel
+    fileHeaderParser(alphaMask);        // Mask for alpha channel
+
+    fileHeaderParser(CSType);           // Color space type
+
+    if (!CSType)
+        throw std::runtime_error("Custom color space is not supported");
+
+    offset += 48;      // Skip color whatever
+
+    if (structSize == BMP_V5_HEADER_SIZE) {
+        offBits -= 16;
+        structSize = BMP_V4_HEADER_SIZE;
+        fseek(input, BMP_V5_HEADER_SIZE - BMP_V4_HEADER_SIZE, SEEK_CUR);    // Skip "redundant" bytes (F in chat)
+    }
+
+
+    image = unique_ptr<unsigned char[], free_deleter>(allocatePixels(static_cast<size_t>(width) * height * 4));
+
+    if (fread(image.get(), sizeof(unsigned char), imageSize, input) != imageSize)
+        throw std::runtime_error("Pixel data is truncated");
+
+    ConvertTo(format);
+}
+
+// Header of 32-bit BMP v4 file with bitmasks, for images which were not loaded from a file
+void BitMapImage::initHeader() {
+    structSize = BMP_V4_HEADER_SIZE;
+    offBits = BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE;
+    imageSize = width * height * 4;
+    fileSize = offBits + imageSize;
+    planes = 1;
+    bitCount = 32;
+    compression = 3;                     // BI_BITFIELDS
+    Xppm = 2835;                         // 72 DPI
+    Yppm = 2835;
+    clrUsed = 0;
+    clrImportant = 0;
+    redMask = 0x00ff0000;
+    greenMask = 0x0000ff00;
+    blueMask = 0x000000ff;
+    alphaMask = 0xff000000;
+    CSType = 0x73524742;                 // 'sRGB'
+}
+
+BitMapImage::BitMapImage(int width, int height, PixelFormat format) : width(width), height(height), format(format) {
+    initHeader();
+
+    size_t size = static_cast<size_t>(width) * height * BytesPerPixel(format);
+    image.reset(allocatePixels(size));
+    memset(image.get(), 0, size);
+}
+
+BitMapImage::BitMapImage(int width, int height, unsigned char *pixels, PixelFormat format) : width(width),
+                                                                                             height(height),
+                                                                                             format(format) {
+    initHeader();
+
+    image.reset(pixels);
+    image.get_deleter().owned = false;
+}
+
+size_t BitMapImage::BytesPerPixel(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::BGRA16:
+            return 8;
+        case PixelFormat::BGRA32F:
+            return 16;
+        default:
+            return 4;
+    }
+}
+
+// 8-bit channel to 16-bit one is x * 257, which is exactly what interleaving a byte with itself does
+static void convert8To16(const unsigned char *src, unsigned short *dst, size_t pixels) {
+    size_t i = 0;
+
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4)),
+                                                 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_unpacklo_epi8(bytes, bytes));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4 + 16), _mm256_unpackhi_epi8(bytes, bytes));
+    }
+
+    for (i *= 4; i < pixels * 4; i++)
+        dst[i] = src[i] * 257;
+}
+
+// Rounded x / 257, exact for every x = c * 257
+static void convert16To8(const unsigned short *src, unsigned char *dst, size_t pixels) {
+    const __m256i half = _mm256_set1_epi16(128);
+    size_t i = 0;
+
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4 + 16));
+
+        low = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(low, _mm256_srli_epi16(low, 8)), half), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(high, _mm256_srli_epi16(high, 8)), half), 8);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8));
+    }
+
+    for (i *= 4; i < pixels * 4; i++)
+        dst[i] = (src[i] - (src[i] >> 8) + 128) >> 8;
+}
+
+static void convert8ToFloat(const unsigned char *src, float *dst, size_t pixels) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 255);
+    size_t i = 0;
+
+    for (; i + 2 <= pixels; i += 2) {
+        __m256i channels = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i * 4)));
+        _mm256_storeu_ps(dst + i * 4, _mm256_mul_ps(_mm256_cvtepi32_ps(channels), scale));
+    }
+
+    for (i *= 4; i < pixels * 4; i++)
+        dst[i] = src[i] / 255.0f;
+}
+
+// Values are clamped to [0, 1] by saturating packs
+static void convertFloatTo8(const float *src, unsigned char *dst, size_t pixels) {
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i channels[4];
+
+        for (int part = 0; part < 4; part++)
+            channels[part] = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i * 4 + part * 8), scale));
+
+        __m256i words = _mm256_packus_epi16(_mm256_packus_epi32(channels[0], channels[1]),
+                                            _mm256_packus_epi32(channels[2], channels[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_permutevar8x32_epi32(words, order));
+    }
+
+    for (i *= 4; i < pixels * 4; i++)
+        dst[i] = static_cast<unsigned char>(std::min(std::max(src[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Converts pixels between any two formats, passing through 8 bits when neither of them is 8-bit
+static void convertPixels(const unsigned char *src, PixelFormat from, unsigned char *dst, PixelFormat to,
+                          size_t pixels) {
+    if (from == to) {
+        memcpy(dst, src, pixels * BitMapImage::BytesPerPixel(from));
+        return;
+    }
+
+    if (from != PixelFormat::BGRA8 && to != PixelFormat::BGRA8) {
+        unique_ptr<unsigned char[], free_deleter> narrow(allocatePixels(pixels * 4));
+        convertPixels(src, from, narrow.get(), PixelFormat::BGRA8, pixels);
+        convertPixels(narrow.get(), PixelFormat::BGRA8, dst, to, pixels);
+        return;
+    }
+
+    if (to == PixelFormat::BGRA16)
+        convert8To16(src, reinterpret_cast<unsigned short *>(dst), pixels);
+    else if (to == PixelFormat::BGRA32F)
+        convert8ToFloat(src, reinterpret_cast<float *>(dst), pixels);
+    else if (from == PixelFormat::BGRA16)
+        convert16To8(reinterpret_cast<const unsigned short *>(src), dst, pixels);
+    else
+        convertFloatTo8(reinterpret_cast<const float *>(src), dst, pixels);
+}
+
+void BitMapImage::ConvertTo(PixelFormat newFormat) {
+    if (newFormat == format)
+        return;
+
+    size_t pixels = static_cast<size_t>(width) * height;
+    unique_ptr<unsigned char[], free_deleter> converted(allocatePixels(pixels * BytesPerPixel(newFormat)));
+
+    convertPixels(image.get(), format, converted.get(), newFormat, pixels);
+    MarkModified();
+
+    image = std::move(converted);
+    format = newFormat;
+}
+
+// Opacity and tint as multipliers for two float pixels
+static __m256 floatModulation(const BlendOptions &options) {
+    return _mm256_setr_ps(options.tintBlue / 255.0f, options.tintGreen / 255.0f, options.tintRed / 255.0f,
+                          options.opacity / 255.0f, options.tintBlue / 255.0f, options.tintGreen / 255.0f,
+                          options.tintRed / 255.0f, options.opacity / 255.0f);
+}
+
+/*
+ * High precision blending. Pixels are widened to floats, so one __m256 holds two pixels and alpha of each is
+ * broadcast inside its 128-bit half. Modulation is opacity and tint from BlendOptions divided by 255, alphaScale
+ * maps alpha to [0, 1] (1 / 65535 for 16-bit channels).
+ */
+static inline __m256 blendPixelsFloat(__m256 bkg, __m256 frg, __m256 modulation, __m256 alphaScale) {
+    frg = _mm256_mul_ps(frg, modulation);
+    __m256 alpha = _mm256_mul_ps(_mm256_permute_ps(frg, 0xFF), alphaScale);
+    __m256 result = _mm256_fmadd_ps(_mm256_sub_ps(frg, bkg), alpha, bkg);
+
+    return _mm256_blend_ps(result, bkg, 0x88);                      // Keep background alpha as 8-bit blending does
+}
+
+static void blendRow16(unsigned short *bkg, const unsigned short *frg, unsigned int count, __m256 modulation) {
+    const __m256 alphaScale = _mm256_set1_ps(1.0f / 65535);
+    unsigned int xcur = 0;
+
+    for (; xcur + 2 <= count; xcur += 2) {
+        __m128i *dst = reinterpret_cast<__m128i *>(bkg + xcur * 4);
+
+        __m256 bkgPixels = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(dst)));
+        __m256 frgPixels = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(frg + xcur * 4))));
+
+        __m256i result = _mm256_cvtps_epi32(blendPixelsFloat(bkgPixels, frgPixels, modulation, alphaScale));
+        _mm_storeu_si128(dst, _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1)));
+    }
+
+    if (xcur < count) {
+        alignas(32) float bkgPixel[8] = {};
+        alignas(32) float frgPixel[8] = {};
+        alignas(32) float result[8];
+
+        for (int channel = 0; channel < 4; channel++) {
+            bkgPixel[channel] = bkg[xcur * 4 + channel];
+            frgPixel[channel] = frg[xcur * 4 + channel];
+        }
+
+        _mm256_store_ps(result, blendPixelsFloat(_mm256_load_ps(bkgPixel), _mm256_load_ps(frgPixel), modulation,
+                                                 alphaScale));
+
+        for (int channel = 0; channel < 4; channel++)
+            bkg[xcur * 4 + channel] = static_cast<unsigned short>(std::min(std::max(result[channel] + 0.5f, 0.0f),
+                                                                           65535.0f));
+    }
+}
+
+static void blendRowFloat(float *bkg, const float *frg, unsigned int count, __m256 modulation) {
+    const __m256 alphaScale = _mm256_set1_ps(1.0f);
+    unsigned int xcur = 0;
+
+    for (; xcur + 2 <= count; xcur += 2)
+        _mm256_storeu_ps(bkg + xcur * 4, blendPixelsFloat(_mm256_loadu_ps(bkg + xcur * 4),
+                                                          _mm256_loadu_ps(frg + xcur * 4), modulation, alphaScale));
+
+    if (xcur < count) {
+        __m128 result = _mm256_castps256_ps128(
+                blendPixelsFloat(_mm256_castps128_ps256(_mm_loadu_ps(bkg + xcur * 4)),
+                                 _mm256_castps128_ps256(_mm_loadu_ps(frg + xcur * 4)), modulation, alphaScale));
+        _mm_storeu_ps(bkg + xcur * 4, result);
+    }
+}
+
+void BitMapImage::blendHighPrecision(const BitMapImage &foreground, unsigned int x, unsigned int y,
+                                     const BlendOptions &options) {
+    const __m256 modulation = floatModulation(options);
+    const size_t pixelSize = BytesPerPixel(format);
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        unsigned char *bkg = image.get() + ((static_cast<size_t>(y + ycur) * width) + x) * pixelSize;
+        const unsigned char *frg = foreground.image.get() + static_cast<size_t>(ycur) * foreground.width * pixelSize;
+
+        if (format == PixelFormat::BGRA16)
+            blendRow16(reinterpret_cast<unsigned short *>(bkg), reinterpret_cast<const unsigned short *>(frg),
+                       foreground.width, modulation);
+        else
+            blendRowFloat(reinterpret_cast<float *>(bkg), reinterpret_cast<const float *>(frg), foreground.width,
+                          modulation);
+    }
+}
+
+void BitMapImage::Save(const char *filename) const {
+    LatencyMetrics::Timer timer(LatencyMetrics::Save);
+    size_t nameLength = strlen(filename);
+
+    if (nameLength > 4 && !strcasecmp(filename + nameLength - 4, ".qoi")) {
+        SaveQoi(filename);
+        return;
+    }
+
+    unique_ptr<unsigned char[]> outBuffer(new unsigned char[BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE]);
+
+    auto writer = bufferWriter(outBuffer);
+
+    writer(BMP_SIGNATURE);                               // Bitmap image signature
+    writer(fileSize);                                    // Filesize
+    writer(static_cast<unsigned int>(0));               // Reserved fields
+    writer(offBits);                                     // Offset to the beginning of the image
+    writer(structSize);                                  // Header structure size
+    writer(width);
+    writer(height);
+    writer(planes);
+    writer(bitCount);
+    writer(compression);
+    writer(imageSize);
+    writer(Xppm);
+    writer(Yppm);
+    writer(clrUsed);
+    writer(clrImportant);
+    writer(redMask);
+    writer(greenMask);
+    writer(blueMask);
+    writer(alphaMask);
+
+    writer(CSType);
+
+    writer(static_cast<unsigned long long> (0));
+    writer(static_cast<unsigned long long> (0));
+    writer(static_cast<unsigned long long> (0));
+    writer(static_cast<unsigned long long> (0));
+    writer(static_cast<unsigned long long> (0));
+    writer(static_cast<unsigned long long> (0));
+
+    unique_ptr<FILE, decltype(&fclose)> output(fopen(filename, "wb"), &fclose);
+
+    if (!output)
+        throw std::runtime_error("Cannot create file");
+
+    const size_t headerSize = BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE;
+    bool written = fwrite(outBuffer.get(), sizeof(unsigned char), headerSize, output.get()) == headerSize;
+
+    if (format == PixelFormat::BGRA8) {
+        written = written && fwrite(image.get(), sizeof(unsigned char), imageSize, output.get()) == imageSize;
+    } else {
+        size_t pixels = static_cast<size_t>(width) * height;
+        unique_ptr<unsigned char[], free_deleter> narrow(allocatePixels(pixels * 4));
+        convertPixels(image.get(), format, narrow.get(), PixelFormat::BGRA8, pixels);
+        written = written && fwrite(narrow.get(), sizeof(unsigned char), imageSize, output.get()) == imageSize;
+    }
+
+    // Full disk often shows only when buffered data is flushed on close
+    if (fclose(output.release()) != 0 || !written)
+        throw std::runtime_error("Cannot write file");
+}
+
+void BitMapImage::PatchFile(const char *filename, const BitMapImage &foreground, unsigned int x, unsigned int y,
+                            const BlendOptions &options) {
+    if (foreground.format != PixelFormat::BGRA8)
+        throw std::runtime_error("Only 8-bit foreground can be patched into a file");
+
+    int file = open(filename, O_RDWR);
+
+    if (file < 0)
+        throw std::runtime_error("Cannot open file");
+
+    unique_ptr<int, void (*)(int *)> closer(&file, [](int *fd) { close(*fd); });
+    const ssize_t headerSize = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE;
+    unique_ptr<unsigned char[]> header = std::make_unique<unsigned char[]>(headerSize);
+
+    if (pread(file, header.get(), headerSize, 0) != headerSize)
+        throw std::runtime_error("BMP header is truncated");
+
+    size_t offset = 0;
+    auto headerParser = parserWrapper(offset, header);
+    unsigned short signature = 0;
+    unsigned int fileOffBits = 0;
+    int fileWidth = 0;
+    int fileHeight = 0;
+    unsigned short fileBitCount = 0;
+    unsigned int fileCompression = 0;
+
+    headerParser(signature);
+
+    if (signature != BMP_SIGNATURE)
+        throw std::runtime_error("Invalid file signature");
+
+    offset += 8;                         // File size and reserved fields
+    headerParser(fileOffBits);
+    offset += 4;                         // Header structure size
+    headerParser(fileWidth);
+    headerParser(fileHeight);
+    offset += 2;                         // Planes
+    headerParser(fileBitCount);
+    headerParser(fileCompression);
+
+    if (fileBitCount != 32 || (fileCompression != 0 && fileCompression != 3 && fileCompression != 6))
+        throw std::runtime_error("Only uncompressed 32-bit pixels can be patched");
+
+    bool topDown = fileHeight < 0;
+    unsigned int rows = topDown ? -fileHeight : fileHeight;
+
+    if (fileWidth <= 0 || x + foreground.width > static_cast<unsigned int>(fileWidth) ||
+        y + foreground.height > rows)
+        throw std::runtime_error("Foreground does not fit into background");
+
+    // Only the overlapped span of every row is read, blended as a separate image and written back
+    size_t spanSize = static_cast<size_t>(foreground.width) * 4;
+    BitMapImage patch(foreground.width, foreground.height);
+
+    auto spanOffset = [&](unsigned int row) {
+        unsigned int fileRow = topDown ? rows - 1 - row : row;
+        return static_cast<off_t>(fileOffBits) + (static_cast<off_t>(fileRow) * fileWidth + x) * 4;
+    };
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        if (pread(file, patch.image.get() + ycur * spanSize, spanSize, spanOffset(y + ycur)) !=
+            static_cast<ssize_t>(spanSize))
+            throw std::runtime_error("Cannot read pixels of the file");
+    }
+
+    patch.Blend(foreground, 0, 0, options);
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        if (pwrite(file, patch.image.get() + ycur * spanSize, spanSize, spanOffset(y + ycur)) !=
+            static_cast<ssize_t>(spanSize))
+            throw std::runtime_error("Cannot write pixels of the file");
+    }
+}
+
+// Blending with global opacity and tint, modulation is described at blendPixels
+static void blendRowModulated(unsigned char *bkg, const unsigned char *frg, unsigned int count,
+                              const unsigned short *modulation) {
+    const __m256i modulationVector = _mm256_set1_epi64x(static_cast<long long>(modulation[0]) |
+                                                        static_cast<long long>(modulation[1]) << 16 |
+                                                        static_cast<long long>(modulation[2]) << 32 |
+                                                        static_cast<long long>(modulation[3]) << 48);
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+
+        _mm256_storeu_si256(dst, blendPixels<true>(_mm256_lddqu_si256(dst), frgPixels, modulationVector));
+    }
+
+    for (; xcur < count; xcur++)
+        blendPixel<true>(bkg + (xcur << 2), frg + (xcur << 2), modulation);
+}
+
+template<bool Modulated>
+static void blendRowExact(unsigned char *bkg, const unsigned char *frg, unsigned int count,
+                          const unsigned short *modulation) {
+    const __m256i modulationVector = _mm256_set1_epi64x(static_cast<long long>(modulation[0]) |
+                                                        static_cast<long long>(modulation[1]) << 16 |
+                                                        static_cast<long long>(modulation[2]) << 32 |
+                                                        static_cast<long long>(modulation[3]) << 48);
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+
+        _mm256_storeu_si256(dst, blendPixelsExact<Modulated>(_mm256_lddqu_si256(dst), frgPixels, modulationVector));
+    }
+
+    for (; xcur < count; xcur++)
+        blendPixelExact<Modulated>(bkg + (xcur << 2), frg + (xcur << 2), modulation);
+}
+
+/*
+ * Same as blendRowTuned, but result is written with non-temporal stores so that composites larger than the last level
+ * cache do not evict everything else on their way to memory. Streaming stores need 32-byte aligned destination,
+ * so pixels before the first aligned address are blended one by one.
+ */
+static void blendRowStreaming(unsigned char *bkg, const unsigned char *frg, unsigned int count) {
+    unsigned int xcur = 0;
+
+    for (; xcur < count && (reinterpret_cast<uintptr_t>(bkg + (xcur << 2)) & 31); xcur++)
+        blendPixel(bkg + (xcur << 2), frg + (xcur << 2));
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i bkgPixels = _mm256_load_si256(reinterpret_cast<const __m256i *>(bkg + (xcur << 2)));
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(bkg + (xcur << 2)), blendPixels(bkgPixels, frgPixels));
+    }
+
+    for (; xcur < count; xcur++)
+        blendPixel(bkg + (xcur << 2), frg + (xcur << 2));
+}
+
+const int LINEAR_LUT_SIZE = 4096;
+
+// Tables for sRGB transfer function: byte to linear float, and linear value quantized to 12 bits back to byte
+struct SrgbTables {
+    float toLinear[256];
+    int toSrgb[LINEAR_LUT_SIZE];
+
+    SrgbTables() {
+        for (int i = 0; i < 256; i++) {
+            double value = i / 255.0;
+            toLinear[i] = static_cast<float>(value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4));
+        }
+
+        // Picking the byte with the nearest linear value makes byte -> linear -> byte round trip exact
+        int nearest = 0;
+
+        for (int i = 0; i < LINEAR_LUT_SIZE; i++) {
+            float linear = static_cast<float>(i) / (LINEAR_LUT_SIZE - 1);
+
+            while (nearest < 255 && fabs(toLinear[nearest + 1] - linear) <= fabs(toLinear[nearest] - linear))
+                nearest++;
+
+            toSrgb[i] = nearest;
+        }
+    }
+};
+
+static const SrgbTables &srgbTables() {
+    static const SrgbTables tables;
+    return tables;
+}
+
+/*
+ * Gamma-correct blending of eight pixels. Channels are split into separate vectors of eight 32-bit lanes, colors are
+ * decoded to linear light with a gather from 256-entry table, blended with FMA and encoded back with a gather from
+ * 4096-entry table. Alpha is linear already, so it is only scaled to [0, 1]. Tints and opacity are the components
+ * of floatModulation broadcast to whole vectors.
+ */
+static inline __m256i blendPixelsLinear(__m256i bkg, __m256i frg, const __m256 *tints, __m256 opacity,
+                                        const SrgbTables &tables) {
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256 encodeScale = _mm256_set1_ps(LINEAR_LUT_SIZE - 1);
+
+    __m256 alpha = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(frg, 24)), opacity);
+    __m256i result = _mm256_andnot_si256(_mm256_set1_epi32(0x00ffffff), bkg);       // Background alpha is kept
+
+    for (int channel = 0; channel < 3; channel++) {
+        __m256i bkgChannel = _mm256_and_si256(_mm256_srli_epi32(bkg, channel * 8), byteMask);
+        __m256i frgChannel = _mm256_and_si256(_mm256_srli_epi32(frg, channel * 8), byteMask);
+
+        __m256 bkgLinear = _mm256_i32gather_ps(tables.toLinear, bkgChannel, 4);
+        __m256 frgLinear = _mm256_mul_ps(_mm256_i32gather_ps(tables.toLinear, frgChannel, 4), tints[channel]);
+
+        __m256 mixed = _mm256_fmadd_ps(_mm256_sub_ps(frgLinear, bkgLinear), alpha, bkgLinear);
+        __m256i encoded = _mm256_i32gather_epi32(tables.toSrgb, _mm256_cvtps_epi32(_mm256_mul_ps(mixed, encodeScale)),
+                                                 4);
+
+        result = _mm256_or_si256(result, _mm256_slli_epi32(encoded, channel * 8));
+    }
+
+    return result;
+}
+
+static void blendRowLinear(unsigned char *bkg, const unsigned char *frg, unsigned int count, __m256 modulation) {
+    const SrgbTables &tables = srgbTables();
+    const __m256 tints[3] = {_mm256_permute_ps(modulation, 0x00), _mm256_permute_ps(modulation, 0x55),
+                             _mm256_permute_ps(modulation, 0xAA)};
+    const __m256 opacity = _mm256_mul_ps(_mm256_permute_ps(modulation, 0xFF), _mm256_set1_ps(1.0f / 255));
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+
+    // Opaque pixels of untinted layer are just copied, there is no need to go through the transfer function
+    const bool plainColors = _mm256_movemask_ps(_mm256_cmp_ps(modulation, _mm256_set1_ps(1.0f), _CMP_NEQ_OQ)) == 0;
+
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+        __m256i frgAlpha = _mm256_and_si256(frgPixels, alphaMask);
+
+        if (_mm256_testz_si256(frgAlpha, frgAlpha))
+            continue;                                               // Fully transparent
+
+        __m256i bkgPixels = _mm256_lddqu_si256(dst);
+
+        if (plainColors && _mm256_testc_si256(frgAlpha, alphaMask))
+            _mm256_storeu_si256(dst, _mm256_blendv_epi8(frgPixels, bkgPixels, alphaMask));
+        else
+            _mm256_storeu_si256(dst, blendPixelsLinear(bkgPixels, frgPixels, tints, opacity, tables));
+    }
+
+    for (; xcur < count; xcur++) {
+        unsigned int bkgPixel = 0;
+        unsigned int frgPixel = 0;
+
+        memcpy(&bkgPixel, bkg + (xcur << 2), 4);
+        memcpy(&frgPixel, frg + (xcur << 2), 4);
+
+        unsigned int result = _mm256_extract_epi32(blendPixelsLinear(_mm256_set1_epi32(bkgPixel),
+                                                                     _mm256_set1_epi32(frgPixel), tints, opacity,
+                                                                     tables), 0);
+        memcpy(bkg + (xcur << 2), &result, 4);
+    }
+}
+
+/*
+ * Sprites of sizes known at compile time: loops have constant trip counts and no tails, so the compiler turns them into
+ * straight-line code. 16x16 sprite is unrolled completely, bigger ones are unrolled by 16 rows.
+ */
+template<unsigned int Width, unsigned int Height>
+static void blendFixedSize(unsigned char *bkg, size_t bkgStride, const unsigned char *frg) {
+    static_assert(Width % 8 == 0 && Height % 16 == 0, "Rows must consist of whole vectors");
+
+#pragma GCC unroll 16
+    for (unsigned int row = 0; row < Height; row++) {
+#pragma GCC unroll 8
+        for (unsigned int column = 0; column < Width; column += 8) {
+            __m256i *dst = reinterpret_cast<__m256i *>(bkg + row * bkgStride + (column << 2));
+            const __m256i *src = reinterpret_cast<const __m256i *>(frg + ((row * Width + column) << 2));
+
+            _mm256_storeu_si256(dst, blendPixels(_mm256_lddqu_si256(dst), _mm256_lddqu_si256(src)));
+        }
+    }
+}
+
+using FixedSizeKernel = void (*)(unsigned char *, size_t, const unsigned char *);
+
+// Specialized kernel for sprites of common icon sizes, nullptr for any other size
+static FixedSizeKernel fixedSizeKernel(int width, int height) {
+    if (width != height)
+        return nullptr;
+
+    switch (width) {
+        case 16:
+            return blendFixedSize<16, 16>;
+        case 32:
+            return blendFixedSize<32, 32>;
+        case 64:
+            return blendFixedSize<64, 64>;
+        default:
+            return nullptr;
+    }
+}
+
+void BitMapImage::Blend(const BitMapImage &foreground, unsigned int x, unsigned int y, const BlendOptions &options) {
+    // Blends of fewer pixels take a few microseconds, where 90 ns of the timer would be noticeable
+    std::optional<LatencyMetrics::Timer> timer;
+
+    if (static_cast<size_t>(foreground.width) * foreground.height >= timedBlendPixels)
+        timer.emplace(LatencyMetrics::Blend);
+
+    MarkModified();
+    blend(foreground, x, y, options);
+}
+
+void BitMapImage::blend(const BitMapImage &foreground, unsigned int x, unsigned int y, const BlendOptions &options) {
+    if (format != foreground.format)
+        throw std::runtime_error("Pixel formats of images must match");
+
+    if (format != PixelFormat::BGRA8) {
+        if (options.linearLight)
+            throw std::runtime_error("Linear light blending is only supported for 8-bit pixels");
+
+        blendHighPrecision(foreground, x, y, options);
+        return;
+    }
+
+    unsigned char *bkg_ptr = image.get();
+    const unsigned char *frg_ptr = foreground.image.get();
+
+    if (options.linearLight) {
+        const __m256 modulation = floatModulation(options);
+
+        for (int ycur = 0; ycur < foreground.height; ycur++) {
+            size_t bkg_pos = ((static_cast<size_t>(y + ycur) * width) + x) << 2;
+            size_t frg_pos = (static_cast<size_t>(ycur) * foreground.width) << 2;
+
+            blendRowLinear(bkg_ptr + bkg_pos, frg_ptr + frg_pos, foreground.width, modulation);
+        }
+
+        return;
+    }
+
+    bool modulated = options.opacity != 255 || options.tintRed != 255 || options.tintGreen != 255 ||
+                     options.tintBlue != 255;
+
+    if (options.exact) {
+        const unsigned short modulation[4] = {options.tintBlue, options.tintGreen, options.tintRed, options.opacity};
+
+        for (int ycur = 0; ycur < foreground.height; ycur++) {
+            size_t bkg_pos = ((static_cast<size_t>(y + ycur) * width) + x) << 2;
+            size_t frg_pos = (static_cast<size_t>(ycur) * foreground.width) << 2;
+
+            if (modulated)
+                blendRowExact<true>(bkg_ptr + bkg_pos, frg_ptr + frg_pos, foreground.width, modulation);
+            else
+                blendRowExact<false>(bkg_ptr + bkg_pos, frg_ptr + frg_pos, foreground.width, modulation);
+        }
+
+        return;
+    }
+
+    if (modulated) {
+        const unsigned short modulation[4] = {static_cast<unsigned short>(options.tintBlue + 1),
+                                              static_cast<unsigned short>(options.tintGreen + 1),
+                                              static_cast<unsigned short>(options.tintRed + 1),
+                                              static_cast<unsigned short>(options.opacity + 1)};
+
+        for (int ycur = 0; ycur < foreground.height; ycur++) {
+            size_t bkg_pos = ((static_cast<size_t>(y + ycur) * width) + x) << 2;
+            size_t frg_pos = (static_cast<size_t>(ycur) * foreground.width) << 2;
+
+            blendRowModulated(bkg_ptr + bkg_pos, frg_ptr + frg_pos, foreground.width, modulation);
+        }
+
+        return;
+    }
+
+    if (fixedSizeSprites.load(std::memory_order_relaxed)) {
+        if (FixedSizeKernel kernel = fixedSizeKernel(foreground.width, foreground.height)) {
+            kernel(bkg_ptr + (((static_cast<size_t>(y) * width) + x) << 2), static_cast<size_t>(width) << 2, frg_ptr);
+            return;
+        }
+    }
+
+    size_t blendedArea = static_cast<size_t>(foreground.width) * foreground.height * 4;
+    // Destination won't stay in cache anyway
+    bool streaming = blendedArea > streamingThreshold.load(std::memory_order_relaxed);
+
+    if (!streaming) {
+        tunedKernel()(bkg_ptr + (((static_cast<size_t>(y) * width) + x) << 2), static_cast<size_t>(width) << 2,
+                      frg_ptr, static_cast<size_t>(foreground.width) << 2, foreground.width, foreground.height);
+        return;
+    }
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        size_t bkg_pos = ((static_cast<size_t>(y + ycur) * width) + x) << 2;
+        size_t frg_pos = (static_cast<size_t>(ycur) * foreground.width) << 2;
+
+        blendRowStreaming(bkg_ptr + bkg_pos, frg_ptr + frg_pos, foreground.width);
+    }
+
+    _mm_sfence();                                                 // Make streamed pixels visible to other cores
+}
+
+// Blends single rows with the same kernels Blend picks for given options, pixels are counted in elements of format
+class RowBlender {
+private:
+    enum class Kernel { Tuned, Modulated, Exact, ExactModulated, Linear, Wide16, WideFloat };
+
+    Kernel kernel;
+    BlendKernel tuned = nullptr;
+    unsigned short modulation[4];
+    __m256 floatModulationVector;
+
+public:
+    RowBlender(PixelFormat format, const BlendOptions &options) {
+        bool modulated = options.opacity != 255 || options.tintRed != 255 || options.tintGreen != 255 ||
+                         options.tintBlue != 255;
+        int plusOne = options.exact ? 0 : 1;                         // See blendPixels and blendPixelsExact
+
+        modulation[0] = options.tintBlue + plusOne;
+        modulation[1] = options.tintGreen + plusOne;
+        modulation[2] = options.tintRed + plusOne;
+        modulation[3] = options.opacity + plusOne;
+        floatModulationVector = floatModulation(options);
+
+        if (format != PixelFormat::BGRA8) {
+            if (options.linearLight)
+                throw std::runtime_error("Linear light blending is only supported for 8-bit pixels");
+
+            kernel = format == PixelFormat::BGRA16 ? Kernel::Wide16 : Kernel::WideFloat;
+        } else if (options.linearLight) {
+            kernel = Kernel::Linear;
+        } else if (options.exact) {
+            kernel = modulated ? Kernel::ExactModulated : Kernel::Exact;
+        } else if (modulated) {
+            kernel = Kernel::Modulated;
+        } else {
+            kernel = Kernel::Tuned;
+            tuned = tunedKernel();
+        }
+    }
+
+    void operator()(unsigned char *bkg, const unsigned char *frg, unsigned int count) const {
+        switch (kernel) {
+            case Kernel::Tuned:
+                tuned(bkg, 0, frg, 0, count, 1);
+                break;
+            case Kernel::Modulated:
+                blendRowModulated(bkg, frg, count, modulation);
+                break;
+            case Kernel::Exact:
+                blendRowExact<false>(bkg, frg, count, modulation);
+                break;
+            case Kernel::ExactModulated:
+                blendRowExact<true>(bkg, frg, count, modulation);
+                break;
+            case Kernel::Linear:
+                blendRowLinear(bkg, frg, count, floatModulationVector);
+                break;
+            case Kernel::Wide16:
+                blendRow16(reinterpret_cast<unsigned short *>(bkg), reinterpret_cast<const unsigned short *>(frg),
+                           count, floatModulationVector);
+                break;
+            case Kernel::WideFloat:
+                blendRowFloat(reinterpret_cast<float *>(bkg), reinterpret_cast<const float *>(frg), count,
+                              floatModulationVector);
+                break;
+        }
+    }
+};
+
+// Smallest band of BlendTiled given to another thread, about 50 us of blending
+static const size_t tiledBandPixels = 64 * 1024;
+
+// Non-negative remainder, offsets may point anywhere
+static inline int wrap(int value, int period) {
+    int remainder = value % period;
+    return remainder < 0 ? remainder + period : remainder;
+}
+
+void BitMapImage::BlendTiled(const BitMapImage &pattern, unsigned int spacingX, unsigned int spacingY, int offsetX,
+                             int offsetY, const BlendOptions &options) {
+    if (format != pattern.format)
+        throw std::runtime_error("Pixel formats of images must match");
+
+    MarkModified();
+
+    if (pattern.width <= 0 || pattern.height <= 0)
+        return;
+
+    const RowBlender blendRow(format, options);
+    const size_t pixelSize = BytesPerPixel(format);
+    const int periodX = pattern.width + spacingX;
+    const int periodY = pattern.height + spacingY;
+    const int firstTileX = wrap(offsetX, periodX) - periodX;           // Left edge of the tile covering column 0
+
+    /*
+     * With narrow spacing pattern rows are repeated into rows as wide as the destination, where spacing is filled with
+     * transparent pixels, which leave background intact in every mode. Each destination row is then one long call of
+     * the kernel instead of many short ones with scalar tails.
+     */
+    const bool repeated = spacingX < static_cast<unsigned int>(pattern.width);
+    const size_t repeatedWidth = static_cast<size_t>(width) + periodX;
+    unique_ptr<unsigned char[], free_deleter> repeatedRows;
+
+    if (repeated) {
+        repeatedRows.reset(allocatePixels(repeatedWidth * pattern.height * pixelSize));
+        memset(repeatedRows.get(), 0, repeatedWidth * pattern.height * pixelSize);
+
+        for (int row = 0; row < pattern.height; row++) {
+            unsigned char *dst = repeatedRows.get() + row * repeatedWidth * pixelSize;
+            const unsigned char *src = pattern.image.get() + static_cast<size_t>(row) * pattern.width * pixelSize;
+
+            for (size_t tileX = 0; tileX < repeatedWidth; tileX += periodX)
+                memcpy(dst + tileX * pixelSize, src, std::min<size_t>(pattern.width, repeatedWidth - tileX) * pixelSize);
+        }
+    }
+
+    // Every destination row is visited once, crossing all tiles which cover it
+    auto blendBand = [&](int begin, int end) {
+        for (int ycur = begin; ycur < end; ycur++) {
+            int patternRow = wrap(ycur - offsetY, periodY);
+
+            if (patternRow >= pattern.height)
+                continue;                                               // Row falls into vertical spacing
+
+            unsigned char *bkg = image.get() + static_cast<size_t>(ycur) * width * pixelSize;
+
+            if (repeated) {
+                blendRow(bkg, repeatedRows.get() + (patternRow * repeatedWidth - firstTileX) * pixelSize, width);
+                continue;
+            }
+
+            const unsigned char *frg = pattern.image.get() + static_cast<size_t>(patternRow) * pattern.width * pixelSize;
+
+            for (int tileX = firstTileX; tileX < width; tileX += periodX) {
+                int spanBegin = std::max(tileX, 0);
+                int spanEnd = std::min(tileX + pattern.width, width);
+
+                if (spanBegin < spanEnd)
+                    blendRow(bkg + spanBegin * pixelSize, frg + (spanBegin - tileX) * pixelSize, spanEnd - spanBegin);
+            }
+        }
+    };
+
+    // Bands of at least 64K pixels, so that handing them over to the shared pool is paid off
+    unsigned int bands = std::min<size_t>({std::thread::hardware_concurrency(),
+                                          static_cast<size_t>(width) * height / tiledBandPixels,
+                                          static_cast<size_t>(height)});
+
+    if (bands <= 1) {
+        blendBand(0, height);
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable done;
+    unsigned int remaining = bands - 1;
+    std::exception_ptr failure;
+
+    for (unsigned int band = 1; band < bands; band++) {
+        ThreadPool::Shared().Submit([&, band]() {
+            std::exception_ptr error;
+
+            try {
+                blendBand(height * band / bands, height * (band + 1) / bands);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (error && !failure)
+                failure = error;
+
+            if (--remaining == 0)
+                done.notify_one();
+        });
+    }
+
+    try {
+        blendBand(0, height / bands);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!failure)
+            failure = std::current_exception();
+    }
+
+    // Other bands refer to locals of this call, so they are waited for even when the first one failed
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return remaining == 0; });
+
+    if (failure)
+        std::rethrow_exception(failure);
+}
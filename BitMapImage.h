@@ -0,0 +1,232 @@
+#ifndef ALPHABLENDING_BITMAPIMAGE_H
+#define ALPHABLENDING_BITMAPIMAGE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <type_traits>
+
+// Size of the last level cache in bytes, may be overridden with ALPHABLEND_LLC_SIZE environment variable
+size_t detectCacheSize();
+
+struct free_deleter {
+    template<typename T>
+    void operator()(T *p) const {
+        std::free(const_cast<std::remove_const_t<T> *>(p));
+    }
+};
+
+// Pixel buffers are 32-byte aligned for AVX2, aligned_alloc wants size to be multiple of alignment
+unsigned char *allocatePixels(size_t size);
+
+// Pixels in pages of a new anonymous mapping, which nobody has touched yet, unlike memory reused by malloc
+unsigned char *mapPixels(size_t size);
+void unmapPixels(void *pixels, size_t size);
+
+// Deleter of image pixels, which may also be borrowed from the caller and then are not freed
+struct pixel_deleter {
+    bool owned = true;
+    size_t mapped = 0;                   // Size of pixels from mapPixels, which are unmapped instead of freed
+
+    pixel_deleter() = default;
+
+    pixel_deleter(free_deleter) {}
+
+    template<typename T>
+    void operator()(T *p) const {
+        if (mapped)
+            unmapPixels(const_cast<std::remove_const_t<T> *>(p), mapped);
+        else if (owned)
+            std::free(const_cast<std::remove_const_t<T> *>(p));
+    }
+};
+
+// One byte of coverage per pixel, rows are stored one after another in the same order as pixels of BitMapImage
+struct AlphaMask {
+    int width;
+    int height;
+    const unsigned char *alpha;
+};
+
+struct Color {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char alpha = 255;           // Multiplies the mask
+};
+
+// Foreground alpha is derived from distance to key color in RGB space, alpha of foreground pixels is ignored
+struct ChromaKey {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char tolerance = 40;        // Pixels this close to key color are fully transparent
+    unsigned char softness = 40;         // Over this distance further they fade in, 0 gives hard edges
+};
+
+struct Rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+enum class ScaleFilter {
+    Bilinear,                            // Interpolate between four nearest pixels
+    Box                                  // Average all covered pixels, better for shrinking
+};
+
+enum class PixelFormat {
+    BGRA8,                               // 8 bits per channel, the format of BMP files
+    BGRA16,                              // 16 bits per channel
+    BGRA32F                              // Float channels in [0, 1]
+};
+
+struct BlendOptions {
+    unsigned char opacity = 255;         // Multiplies alpha of every foreground pixel
+    unsigned char tintRed = 255;         // Multiply foreground channels, 255 keeps them as is
+    unsigned char tintGreen = 255;
+    unsigned char tintBlue = 255;
+    bool linearLight = false;            // Decode sRGB before blending and encode result back
+    bool exact = false;                  // Divide by 255 with rounding instead of shifting by 8
+};
+
+// Maps (x, y) to (a * x + b * y + tx, c * x + d * y + ty)
+struct AffineTransform {
+    double a;
+    double b;
+    double c;
+    double d;
+    double tx;
+    double ty;
+
+    static AffineTransform Translation(double tx, double ty);
+    static AffineTransform Rotation(double radians);                // Counter-clockwise around the origin
+    static AffineTransform Scaling(double sx, double sy);
+    static AffineTransform Shear(double kx, double ky);
+
+    AffineTransform operator*(const AffineTransform &other) const;  // Apply other first, then this one
+    AffineTransform Inverted() const;
+};
+
+class ShadowCache;                       // Blurred shadow masks kept between calls, see Shadow.h
+
+class BitMapImage {
+    struct CIEXYZ {
+        unsigned int ciexyzX;
+        unsigned int ciexyzY;
+        unsigned int ciexyzZ;
+    };
+
+    struct CIEXYZTRIPLE {
+        CIEXYZ ciexyzRed;
+        CIEXYZ ciexyzGreen;
+        CIEXYZ ciexyzBlue;
+    };
+
+private:
+    unsigned int fileSize;
+    unsigned int offBits;
+    unsigned int structSize;
+    int width;
+    int height;
+    unsigned short planes;
+    unsigned short bitCount;
+    unsigned int compression;
+    unsigned int imageSize;
+    int Xppm;
+    int Yppm;
+    unsigned int clrUsed;
+    unsigned int clrImportant;
+    unsigned int redMask;
+    unsigned int greenMask;
+    unsigned int blueMask;
+    unsigned int alphaMask;
+    unsigned int CSType;
+    PixelFormat format = PixelFormat::BGRA8;
+    std::unique_ptr<unsigned char[], pixel_deleter> image;
+    uint64_t identity = nextIdentity.fetch_add(1, std::memory_order_relaxed);
+    std::atomic<uint64_t> version{0};                                // Bumped by every change of pixels
+
+    static std::atomic<uint64_t> nextIdentity;
+
+    // Read by every blend on any thread, set rarely, so relaxed atomics are enough
+    static std::atomic<size_t> streamingThreshold;                   // Blended bytes above which stores bypass cache
+    static std::atomic<bool> fixedSizeSprites;                       // Unrolled kernels for 16, 32 and 64 pixel squares
+    static const size_t timedBlendPixels = 4096;                     // Smaller blends are not timed, see Blend
+
+    void blendScaledBilinear(const BitMapImage &foreground, const Rect &dstRect, const Rect &clipped);
+    void blendScaledBox(const BitMapImage &foreground, const Rect &dstRect, const Rect &clipped);
+    void blendHighPrecision(const BitMapImage &foreground, unsigned int x, unsigned int y, const BlendOptions &options);
+    void blend(const BitMapImage &foreground, unsigned int x, unsigned int y,
+               const BlendOptions &options);                        // Blend without timing, for bands of pools
+    void requireFormat8() const;
+    void initHeader();
+    void loadQoi(FILE *input);
+    void loadIndexed(FILE *input);
+
+    friend class NumaPool;                                           // Replaces pixels with ones placed on nodes
+    friend class WorkStealingPool;                                   // Blends bands untimed, times the whole call
+public:
+
+    explicit BitMapImage(const char *filename,
+                         PixelFormat format = PixelFormat::BGRA8);   // Load BMP or QOI image
+    explicit BitMapImage(FILE *input,
+                         PixelFormat format = PixelFormat::BGRA8);   // Decode open file from its beginning
+    BitMapImage(int width, int height,
+                PixelFormat format = PixelFormat::BGRA8);            // Create transparent black image of given size
+    BitMapImage(int width, int height, unsigned char *pixels,
+                PixelFormat format = PixelFormat::BGRA8);            // Use caller-owned pixels without copying
+    void deepCopy(const BitMapImage &other);                         // Actually copy assignment
+    BitMapImage(BitMapImage &&other) noexcept;                       // Move constructor
+    BitMapImage(const BitMapImage &other) = delete;                  // Implicit copying is prohibited
+    BitMapImage &
+    operator=(const BitMapImage &other) = delete;       // No implicit copying in order to avoid memory issues
+    BitMapImage &operator=(BitMapImage &&other);                     // Move assignment
+    ~BitMapImage() noexcept = default;                               // Destructor
+
+    void Blend(const BitMapImage &foreground, unsigned int x, unsigned int y,
+               const BlendOptions &options = BlendOptions());      // Use alpha-blending to add picture on top
+    void BlendTiled(const BitMapImage &pattern, unsigned int spacingX, unsigned int spacingY, int offsetX, int offsetY,
+                    const BlendOptions &options = BlendOptions());  // Repeat pattern over the whole image
+    void BlendScaled(const BitMapImage &foreground, const Rect &dstRect,
+                     ScaleFilter filter = ScaleFilter::Bilinear);   // Resample foreground to fit dstRect and blend it
+    void BlendMask(const AlphaMask &mask, Color color,
+                   unsigned int x, unsigned int y);                 // Fill with solid color through the mask
+    void BlendMasked(const BitMapImage &foreground, const AlphaMask &mask,
+                     unsigned int x, unsigned int y);               // Blend with foreground alpha scaled by the mask
+    void BlendChromaKey(const BitMapImage &foreground, const ChromaKey &key,
+                        unsigned int x, unsigned int y);            // Blend with alpha keyed out of foreground colors
+    void BlendWithShadow(const BitMapImage &foreground, unsigned int x, unsigned int y, int offsetX, int offsetY,
+                         unsigned int radius, Color color,
+                         ShadowCache *cache = nullptr);             // Blend with blurred drop shadow underneath
+    void BlendTransformed(const BitMapImage &foreground,
+                          const AffineTransform &transform);          // Map foreground pixels with transform and blend
+    void Save(const char *filename) const;                           // Save BMP picture, or QOI if name ends with .qoi
+    void SaveQoi(const char *filename) const;                        // Save picture in QOI format
+    void ConvertTo(PixelFormat newFormat);                           // Change precision of pixels in place
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    unsigned char *Pixels() { return image.get(); }
+    const unsigned char *Pixels() const { return image.get(); }
+    PixelFormat Format() const { return format; }
+    uint64_t Identity() const { return identity; }                   // Unique among pictures of the process
+    uint64_t Version() const { return version.load(std::memory_order_relaxed); }
+    void MarkModified() { version.fetch_add(1, std::memory_order_relaxed); }  // After editing Pixels() by hand
+
+    static size_t BytesPerPixel(PixelFormat format);
+
+    static void PatchFile(const char *filename, const BitMapImage &foreground, unsigned int x, unsigned int y,
+                          const BlendOptions &options = BlendOptions());  // Blend into BMP file in place
+
+    static void SetStreamingThreshold(size_t bytes) {                // SIZE_MAX, the default, is off
+        streamingThreshold.store(bytes, std::memory_order_relaxed);
+    }
+    static void SetFixedSizeSprites(bool enabled) { fixedSizeSprites.store(enabled, std::memory_order_relaxed); }
+};
+
+#endif //ALPHABLENDING_BITMAPIMAGE_H
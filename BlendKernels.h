@@ -0,0 +1,215 @@
+#ifndef ALPHABLENDING_BLENDKERNELS_H
+#define ALPHABLENDING_BLENDKERNELS_H
+
+#include <immintrin.h>
+
+/*
+ * Blend eight foreground pixels onto eight background pixels, the alpha channel of the background is kept.
+ * Modulated version first scales each foreground channel by (modulation >> 8), modulation holds
+ * (tint + 1) for color channels and (opacity + 1) for alpha, as 16-bit values in the widened pixel order.
+ */
+template<bool Modulated = false>
+static inline __m256i blendPixels(__m256i bkg, __m256i frg, __m256i modulation = _mm256_setzero_si256()) {
+//
+//    const __m128i low_pixel_line_half = _mm_setr_epi8(0, 0x80, 1, 0x80, 2, 0x80, 3, 0x80, 4, 0x80, 5, 0x80, 6, 0x80, 7,
+//                                                      0x80);
+//    const __m128i high_pixel_line_half = _mm_setr_epi8(8, 0x80, 9, 0x80, 10, 0x80, 11, 0x80, 12, 0x80, 13, 0x80, 14,
+//                                                       0x80, 15, 0x80);
+//    const __m128i alpha_mask = _mm_setr_epi8(6, 0x80, 6, 0x80, 6, 0x80, 6, 0x80, 14, 0x80, 14, 0x80, 14, 0x80, 14,
+//                                             0x80);
+//    const __m128i store_low_half = _mm_setr_epi8(1, 3, 5, 0x80, 9, 11, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+//                                                 0x80, 0x80);
+//    const __m128i store_high_half = _mm_setr_epi8(0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 3, 5, 0x80, 9, 11,
+//                                                  13, 0x80);
+
+    const __m256i zeroes = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0);
+
+    const __m256i alpha_mask = _mm256_setr_epi8(6,  0x80, 6,  0x80, 6,  0x80, 6,  0x80,
+                                                14, 0x80, 14, 0x80, 14, 0x80, 14, 0x80,
+                                                22, 0x80, 22, 0x80, 22, 0x80, 22, 0x80,
+                                                30, 0x80, 30, 0x80, 30, 0x80, 30, 0x80);
+
+    const __m256i store_low_half = _mm256_setr_epi8(1,    3,    5,    0x80, 9,    11,   13,   0x80,
+                                                    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                                                    17,   19,   21,   0x80, 25,   27,   29,   0x80,
+                                                    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80);
+
+    const __m256i store_high_half = _mm256_setr_epi8(0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                                                     1,    3,    5,    0x80, 9,    11,   13,   0x80,
+                                                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                                                     17,   19,   21,   0x80, 25,   27,   29,   0x80);
+
+//    /*
+//     *
+//     * Background: |A3|R3|G3|B3| |A2|R2|G2|B2| |A1|R1|G1|B1| |A0|R0|G0|B0|
+//     * Foreground: |A3|R3|G3|B3| |A2|R2|G2|B2| |A1|R1|G1|B1| |A0|R0|G0|B0|
+//     */
+//    __m128i bkg = _mm_load_si128(reinterpret_cast<const __m128i *>(bkg_ptr + bkg_pos));
+//    __m128i frg = _mm_load_si128(reinterpret_cast<const __m128i *>(frg_ptr + frg_pos));
+
+//    __m128i bkg1 = _mm_shuffle_epi8(bkg, low_pixel_line_half);
+//    __m128i bkg2 = _mm_shuffle_epi8(bkg, high_pixel_line_half);
+
+    __m256i bkg1 = _mm256_unpacklo_epi8(bkg, zeroes);
+    __m256i bkg2 = _mm256_unpackhi_epi8(bkg, zeroes);
+
+//    __m128i frg1 = _mm_shuffle_epi8(frg, low_pixel_line_half);
+//    __m128i frg2 = _mm_shuffle_epi8(frg, high_pixel_line_half);
+
+    __m256i frg1 = _mm256_unpacklo_epi8(frg, zeroes);
+    __m256i frg2 = _mm256_unpackhi_epi8(frg, zeroes);
+
+    if (Modulated) {
+        frg1 = _mm256_srli_epi16(_mm256_mullo_epi16(frg1, modulation), 8);
+        frg2 = _mm256_srli_epi16(_mm256_mullo_epi16(frg2, modulation), 8);
+    }
+
+//    /*
+//     * Diff 1: |__A1|__R1| |__G1|__B1| |__A0|__R0| |__G0|__B0|
+//     * Diff 2: |__A3|__R3| |__G3|__B3| |__A2|__R2| |__G2|__B2|
+//     */
+//
+//    __m128i diff1 = _mm_sub_epi16(frg1, bkg1);
+//    __m128i diff2 = _mm_sub_epi16(frg2, bkg2);
+
+    __m256i diff1 = _mm256_sub_epi16(frg1, bkg1);
+    __m256i diff2 = _mm256_sub_epi16(frg2, bkg2);
+
+//
+//    /*
+//     * Prepare alphas
+//     * Alpha 1: |__A1|__A1| |__A1|__A1| |__A0|__A0| |__A0|__A0|
+//     * Alpha 2: |__A3|__A3| |__A3|__A3| |__A2|__A2| |__A2|__A2|
+//     */
+//    __m128i alpha1 = _mm_shuffle_epi8(frg1, alpha_mask);
+//    __m128i alpha2 = _mm_shuffle_epi8(frg2, alpha_mask);
+
+    __m256i alpha1 = _mm256_shuffle_epi8(frg1, alpha_mask);
+    __m256i alpha2 = _mm256_shuffle_epi8(frg2, alpha_mask);
+
+//    /*
+//     * Multiply alphas
+//     */
+//
+//    diff1 = _mm_mullo_epi16(diff1, alpha1);
+//    diff2 = _mm_mullo_epi16(diff2, alpha2);
+
+    diff1 = _mm256_mullo_epi16(diff1, alpha1);
+    diff2 = _mm256_mullo_epi16(diff2, alpha2);
+
+//
+//    /*
+//     * Exctract result bytes from diffs
+//     */
+//    __m128i res1 = _mm_shuffle_epi8(diff1, store_low_half);
+//    __m128i res2 = _mm_shuffle_epi8(diff2, store_high_half);
+//    __m128i result = _mm_add_epi8(res1, res2);
+//    result = _mm_add_epi8(result, bkg);
+
+    __m256i res1 = _mm256_shuffle_epi8(diff1, store_low_half);
+    __m256i res2 = _mm256_shuffle_epi8(diff2, store_high_half);
+    __m256i result = _mm256_add_epi8(res1, res2);
+    return _mm256_add_epi8(result, bkg);
+}
+
+// Scalar version of blendPixels for row heads and tails that do not fill a whole vector
+template<bool Modulated = false>
+static inline void blendPixel(unsigned char *bkg, const unsigned char *frg, const unsigned short *modulation = nullptr) {
+    int alpha = Modulated ? (frg[3] * modulation[3]) >> 8 : frg[3];
+
+    for (int channel = 2; channel >= 0; channel--) {
+        int color = Modulated ? (frg[channel] * modulation[channel]) >> 8 : frg[channel];
+        bkg[channel] += ((color - bkg[channel]) * alpha) >> 8;
+    }
+}
+
+// Rounded x / 255 for x up to 65025
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline __m256i div255(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+/*
+ * Bit-exact version of blendPixels: result = (bkg * (255 - alpha) + frg * alpha) / 255, rounded to nearest.
+ * Modulation holds tint and opacity themselves (not plus one as in blendPixels), foreground is scaled by
+ * modulation / 255 with the same exact division.
+ */
+template<bool Modulated = false>
+static inline __m256i blendPixelsExact(__m256i bkg, __m256i frg, __m256i modulation = _mm256_setzero_si256()) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i alpha_mask = _mm256_setr_epi8(6,  0x80, 6,  0x80, 6,  0x80, 0x80, 0x80,
+                                                14, 0x80, 14, 0x80, 14, 0x80, 0x80, 0x80,
+                                                22, 0x80, 22, 0x80, 22, 0x80, 0x80, 0x80,
+                                                30, 0x80, 30, 0x80, 30, 0x80, 0x80, 0x80);
+
+    __m256i bkg1 = _mm256_unpacklo_epi8(bkg, zeroes);
+    __m256i bkg2 = _mm256_unpackhi_epi8(bkg, zeroes);
+    __m256i frg1 = _mm256_unpacklo_epi8(frg, zeroes);
+    __m256i frg2 = _mm256_unpackhi_epi8(frg, zeroes);
+
+    if (Modulated) {
+        frg1 = div255(_mm256_mullo_epi16(frg1, modulation));
+        frg2 = div255(_mm256_mullo_epi16(frg2, modulation));
+    }
+
+    // Alpha lanes get zero weight, so background alpha is kept exactly
+    __m256i alpha1 = _mm256_shuffle_epi8(frg1, alpha_mask);
+    __m256i alpha2 = _mm256_shuffle_epi8(frg2, alpha_mask);
+
+    __m256i res1 = _mm256_add_epi16(_mm256_mullo_epi16(bkg1, _mm256_sub_epi16(full, alpha1)),
+                                    _mm256_mullo_epi16(frg1, alpha1));
+    __m256i res2 = _mm256_add_epi16(_mm256_mullo_epi16(bkg2, _mm256_sub_epi16(full, alpha2)),
+                                    _mm256_mullo_epi16(frg2, alpha2));
+
+    return _mm256_packus_epi16(div255(res1), div255(res2));
+}
+
+template<bool Modulated = false>
+static inline void blendPixelExact(unsigned char *bkg, const unsigned char *frg,
+                                   const unsigned short *modulation = nullptr) {
+    int alpha = Modulated ? div255(frg[3] * modulation[3]) : frg[3];
+
+    for (int channel = 2; channel >= 0; channel--) {
+        int color = Modulated ? div255(frg[channel] * modulation[channel]) : frg[channel];
+        bkg[channel] = div255(bkg[channel] * (255 - alpha) + color * alpha);
+    }
+}
+
+/*
+ * Same formula as blendPixels, but alpha comes separately: every color byte of a pixel in alpha holds its weight and
+ * alpha byte holds zero, so that the alpha channel of the background is kept.
+ */
+static inline __m256i blendPixelsWithAlpha(__m256i bkg, __m256i frg, __m256i alpha) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(256);
+
+    __m256i alphaLow = _mm256_unpacklo_epi8(alpha, zeroes);
+    __m256i alphaHigh = _mm256_unpackhi_epi8(alpha, zeroes);
+
+    __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(frg, zeroes), alphaLow),
+                                   _mm256_mullo_epi16(_mm256_unpacklo_epi8(bkg, zeroes),
+                                                      _mm256_sub_epi16(full, alphaLow)));
+    __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(frg, zeroes), alphaHigh),
+                                    _mm256_mullo_epi16(_mm256_unpackhi_epi8(bkg, zeroes),
+                                                       _mm256_sub_epi16(full, alphaHigh)));
+
+    return _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+}
+
+// Spreads per-pixel weights held in the lowest byte of each 32-bit element over color bytes of the pixel
+static inline __m256i spreadAlpha(__m256i weights) {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, -128, 4, 4, 4, -128, 8, 8, 8, -128, 12, 12, 12, -128,
+                                            0, 0, 0, -128, 4, 4, 4, -128, 8, 8, 8, -128, 12, 12, 12, -128);
+    return _mm256_shuffle_epi8(weights, spread);
+}
+
+#endif //ALPHABLENDING_BLENDKERNELS_H
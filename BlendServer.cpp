@@ -0,0 +1,372 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "BlendServer.h"
+#include "LatencyMetrics.h"
+
+// Reads or writes the whole buffer, waiting on non-blocking descriptors too, returns false if connection is closed
+static bool transferAll(int fd, void *buffer, size_t size, bool reading) {
+    unsigned char *bytes = static_cast<unsigned char *>(buffer);
+
+    while (size) {
+        ssize_t done = reading ? read(fd, bytes, size) : write(fd, bytes, size);
+
+        if (done < 0 && errno == EINTR)
+            continue;
+
+        if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd ready = {fd, static_cast<short>(reading ? POLLIN : POLLOUT), 0};
+            poll(&ready, 1, -1);
+            continue;
+        }
+
+        if (done <= 0)
+            return false;
+
+        bytes += done;
+        size -= done;
+    }
+
+    return true;
+}
+
+static void copyName(char *dst, const char *src, size_t size) {
+    if (strlen(src) >= size)
+        throw std::runtime_error("Name is too long");
+
+    strncpy(dst, src, size);
+}
+
+static sockaddr_un socketAddress(const char *path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path is too long");
+
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    return address;
+}
+
+SharedMapping::SharedMapping(const char *name, size_t size, bool writable, bool create) : size(size) {
+    int flags = create ? O_RDWR | O_CREAT | O_EXCL : (writable ? O_RDWR : O_RDONLY);
+    int fd = shm_open(name, flags, 0600);
+
+    if (fd < 0)
+        throw std::runtime_error(std::string("Cannot open shared memory object ") + name);
+
+    struct stat info = {};
+
+    if (create && ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        throw std::runtime_error(std::string("Cannot resize shared memory object ") + name);
+    }
+
+    if (!create && (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < size)) {
+        close(fd);
+        throw std::runtime_error(std::string("Shared memory object is too small: ") + name);
+    }
+
+    address = mmap(nullptr, size, writable || create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (address == MAP_FAILED)
+        throw std::runtime_error(std::string("Cannot map shared memory object ") + name);
+}
+
+SharedMapping::~SharedMapping() {
+    if (address != MAP_FAILED)
+        munmap(address, size);
+}
+
+BlendServer::BlendServer(const char *socketPath, unsigned int threads) : socketPath(socketPath),
+                                                                          pool(new ThreadPool(threads)) {
+    sockaddr_un address = socketAddress(socketPath);
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socketPath);
+
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, 64) != 0)
+        throw std::runtime_error(std::string("Cannot listen on ") + socketPath);
+
+    if (pipe2(wakeup, O_CLOEXEC) != 0)
+        throw std::runtime_error("Cannot create wakeup pipe");
+}
+
+BlendServer::~BlendServer() {
+    pool.reset();                        // Waits for jobs in flight, they still write to the wakeup pipe
+
+    // Connections handed back by the last jobs are owned by nobody else
+    int connection = -1;
+    fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+
+    while (read(wakeup[0], &connection, sizeof(connection)) == sizeof(connection))
+        close(connection);
+
+    close(listener);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    unlink(socketPath.c_str());
+}
+
+std::shared_ptr<const BitMapImage> BlendServer::findBackground(const char *name) {
+    std::lock_guard<std::mutex> lock(backgroundsMutex);
+    auto found = backgrounds.find(name);
+
+    if (found == backgrounds.end())
+        throw std::runtime_error(std::string("Unknown background ") + name);
+
+    return found->second;
+}
+
+JobResponse BlendServer::execute(const JobRequest &request) {
+    JobResponse response = {};
+
+    try {
+        // Strings come straight off the socket, an unterminated one would be read past the end of the request
+        if (!memchr(request.name, 0, sizeof(request.name)) || !memchr(request.path, 0, sizeof(request.path)) ||
+            !memchr(request.output, 0, sizeof(request.output)))
+            throw std::runtime_error("Names must be null-terminated");
+
+        switch (request.type) {
+            case JobType::Load: {
+                auto image = cache.Load(request.path);
+                response.width = image->Width();
+                response.height = image->Height();
+
+                std::lock_guard<std::mutex> lock(backgroundsMutex);
+                backgrounds[request.name] = image;
+                break;
+            }
+            case JobType::Unload: {
+                std::lock_guard<std::mutex> lock(backgroundsMutex);
+
+                if (!backgrounds.erase(request.name))
+                    throw std::runtime_error(std::string("Unknown background ") + request.name);
+                break;
+            }
+            case JobType::Query: {
+                auto background = findBackground(request.name);
+                response.width = background->Width();
+                response.height = background->Height();
+                break;
+            }
+            case JobType::Blend: {
+                auto background = findBackground(request.name);
+                response.width = background->Width();
+                response.height = background->Height();
+
+                if (request.width <= 0 || request.height <= 0 || request.x < 0 || request.y < 0 ||
+                    request.width > background->Width() - request.x ||
+                    request.height > background->Height() - request.y)
+                    throw std::runtime_error("Foreground does not fit into background");
+
+                size_t backgroundSize = static_cast<size_t>(background->Width()) * background->Height() * 4;
+                SharedMapping input(request.path, static_cast<size_t>(request.width) * request.height * 4, false,
+                                    false);
+                SharedMapping output(request.output, backgroundSize, true, false);
+
+                memcpy(output.Data(), background->Pixels(), backgroundSize);
+
+                BitMapImage foreground(request.width, request.height, input.Data());
+                BitMapImage result(background->Width(), background->Height(), output.Data());
+                result.Blend(foreground, request.x, request.y, request.options);
+                break;
+            }
+            case JobType::Shutdown:
+                stopping = true;
+                break;
+            default:
+                throw std::runtime_error("Unknown job type");
+        }
+    } catch (const std::exception &error) {
+        response.status = -1;
+        strncpy(response.message, error.what(), sizeof(response.message) - 1);
+    }
+
+    return response;
+}
+
+void BlendServer::Run() {
+    // Request read so far from a connection, which is non-blocking so that a slow client cannot stall the others
+    struct PartialRequest {
+        JobRequest request;
+        size_t received = 0;
+    };
+
+    // Connections that are waiting for a request, the ones with job in flight are owned by the pool
+    std::map<int, PartialRequest> idle;
+
+    while (!stopping) {
+        std::vector<pollfd> watched = {{listener, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+
+        for (const auto &connection : idle)
+            watched.push_back({connection.first, POLLIN, 0});
+
+        if (poll(watched.data(), watched.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("poll failed");
+        }
+
+        for (size_t i = 2; i < watched.size(); i++) {
+            int connection = watched[i].fd;
+
+            if (!watched[i].revents)
+                continue;
+
+            PartialRequest &partial = idle[connection];
+            ssize_t done = read(connection, reinterpret_cast<unsigned char *>(&partial.request) + partial.received,
+                                sizeof(JobRequest) - partial.received);
+
+            if (done < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+
+            if (done <= 0) {
+                close(connection);
+                idle.erase(connection);
+                continue;
+            }
+
+            partial.received += done;
+
+            if (partial.received < sizeof(JobRequest))
+                continue;
+
+            auto request = std::make_shared<JobRequest>(partial.request);
+            idle.erase(connection);
+
+            pool->Submit([this, connection, request]() {
+                JobResponse response;
+
+                {
+                    LatencyMetrics::Timer job(LatencyMetrics::Job);
+                    response = execute(*request);
+                }
+
+                if (!transferAll(connection, &response, sizeof(response), false)) {
+                    close(connection);
+                    return;
+                }
+
+                if (write(wakeup[1], &connection, sizeof(connection)) != sizeof(connection))
+                    close(connection);
+            });
+        }
+
+        if (watched[1].revents) {
+            int connection = -1;
+
+            if (read(wakeup[0], &connection, sizeof(connection)) == sizeof(connection))
+                idle[connection] = PartialRequest();
+        }
+
+        if (watched[0].revents) {
+            int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+            if (connection >= 0)
+                idle[connection] = PartialRequest();
+        }
+    }
+
+    for (const auto &connection : idle)
+        close(connection.first);
+}
+
+SharedImage::SharedImage(const char *name, int width, int height) : name(name),
+                                                                    mapping(name, static_cast<size_t>(width) * height * 4,
+                                                                            true, true),
+                                                                    image(width, height, mapping.Data()) {}
+
+SharedImage::~SharedImage() {
+    shm_unlink(name.c_str());
+}
+
+BlendClient::BlendClient(const char *socketPath) {
+    sockaddr_un address = socketAddress(socketPath);
+    connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        if (connection >= 0)
+            close(connection);
+        throw std::runtime_error(std::string("Cannot connect to ") + socketPath);
+    }
+}
+
+BlendClient::~BlendClient() {
+    close(connection);
+}
+
+JobResponse BlendClient::call(const JobRequest &request) {
+    JobResponse response = {};
+
+    if (!transferAll(connection, const_cast<JobRequest *>(&request), sizeof(request), false) ||
+        !transferAll(connection, &response, sizeof(response), true))
+        throw std::runtime_error("Connection to blending server is lost");
+
+    if (response.status != 0)
+        throw std::runtime_error(response.message);
+
+    return response;
+}
+
+void BlendClient::LoadBackground(const char *name, const char *path, int &width, int &height) {
+    JobRequest request = {};
+    request.type = JobType::Load;
+    copyName(request.name, name, sizeof(request.name));
+    copyName(request.path, path, sizeof(request.path));
+
+    JobResponse response = call(request);
+    width = response.width;
+    height = response.height;
+}
+
+void BlendClient::UnloadBackground(const char *name) {
+    JobRequest request = {};
+    request.type = JobType::Unload;
+    copyName(request.name, name, sizeof(request.name));
+    call(request);
+}
+
+void BlendClient::QueryBackground(const char *name, int &width, int &height) {
+    JobRequest request = {};
+    request.type = JobType::Query;
+    copyName(request.name, name, sizeof(request.name));
+
+    JobResponse response = call(request);
+    width = response.width;
+    height = response.height;
+}
+
+void BlendClient::Blend(const char *background, const SharedImage &foreground, int x, int y, SharedImage &output,
+                        const BlendOptions &options) {
+    JobRequest request = {};
+    request.type = JobType::Blend;
+    copyName(request.name, background, sizeof(request.name));
+    copyName(request.path, foreground.Name(), sizeof(request.path));
+    copyName(request.output, output.Name(), sizeof(request.output));
+    request.width = foreground.Image().Width();
+    request.height = foreground.Image().Height();
+    request.x = x;
+    request.y = y;
+    request.options = options;
+
+    call(request);
+}
+
+void BlendClient::Shutdown() {
+    JobRequest request = {};
+    request.type = JobType::Shutdown;
+    call(request);
+}
@@ -0,0 +1,127 @@
+#ifndef ALPHABLENDING_BLENDSERVER_H
+#define ALPHABLENDING_BLENDSERVER_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sys/mman.h>
+#include "BitMapImage.h"
+#include "ImageCache.h"
+#include "ThreadPool.h"
+
+/*
+ * Wire format of blending daemon. Every request is answered with exactly one response, both are sent as is over
+ * Unix domain socket, pixels never go through the socket: they are exchanged via POSIX shared memory objects.
+ */
+enum class JobType : unsigned int {
+    Load = 1,                            // Decode BMP at path and keep it resident under name
+    Unload,                              // Forget resident background
+    Query,                               // Report size of resident background
+    Blend,                               // Copy background to output object and blend foreground object on it
+    Shutdown                             // Stop the server once running jobs are finished
+};
+
+const unsigned int JOB_NAME_SIZE = 64;
+const unsigned int JOB_PATH_SIZE = 256;
+
+struct JobRequest {
+    JobType type;
+    char name[JOB_NAME_SIZE];            // Name of resident background
+    char path[JOB_PATH_SIZE];            // Load: file to decode, Blend: shared memory object with foreground
+    char output[JOB_NAME_SIZE];          // Blend: shared memory object receiving the result
+    int width;                           // Blend: foreground size
+    int height;
+    int x;                               // Blend: foreground position
+    int y;
+    BlendOptions options;
+};
+
+struct JobResponse {
+    int status;                          // 0 on success
+    int width;                           // Size of the background
+    int height;
+    char message[128];                   // Error description
+};
+
+// Memory mapping of POSIX shared memory object
+class SharedMapping {
+private:
+    void *address = MAP_FAILED;
+    size_t size = 0;
+
+public:
+    SharedMapping(const char *name, size_t size, bool writable, bool create);
+    SharedMapping(const SharedMapping &other) = delete;
+    SharedMapping &operator=(const SharedMapping &other) = delete;
+    ~SharedMapping();
+
+    unsigned char *Data() const { return static_cast<unsigned char *>(address); }
+};
+
+class BlendServer {
+private:
+    std::string socketPath;
+    int listener = -1;
+    int wakeup[2] = {-1, -1};            // Workers write connection descriptors here when job on them is done
+    std::atomic<bool> stopping{false};
+
+    std::mutex backgroundsMutex;
+    std::map<std::string, std::shared_ptr<const BitMapImage>> backgrounds;
+
+    ImageCache cache;                    // Loading the same file under another name does not decode it again
+    std::unique_ptr<ThreadPool> pool;    // Destroyed first, its jobs use everything above
+
+    std::shared_ptr<const BitMapImage> findBackground(const char *name);
+    JobResponse execute(const JobRequest &request);
+
+public:
+    BlendServer(const char *socketPath, unsigned int threads);
+    BlendServer(const BlendServer &other) = delete;
+    BlendServer &operator=(const BlendServer &other) = delete;
+    ~BlendServer();
+
+    void Run();                                                      // Serve until Shutdown job arrives
+};
+
+// Image living in POSIX shared memory, so that the daemon can read or write its pixels directly
+class SharedImage {
+private:
+    std::string name;
+    SharedMapping mapping;
+    BitMapImage image;
+
+public:
+    SharedImage(const char *name, int width, int height);           // Creates new object, fails if it exists
+    SharedImage(const SharedImage &other) = delete;
+    SharedImage &operator=(const SharedImage &other) = delete;
+    ~SharedImage();                                                  // Unlinks the object
+
+    const char *Name() const { return name.c_str(); }
+    BitMapImage &Image() { return image; }
+    const BitMapImage &Image() const { return image; }
+};
+
+// Client side of the blending daemon, every call waits for the job to finish
+class BlendClient {
+private:
+    int connection = -1;
+
+    JobResponse call(const JobRequest &request);
+
+public:
+    explicit BlendClient(const char *socketPath);
+    BlendClient(const BlendClient &other) = delete;
+    BlendClient &operator=(const BlendClient &other) = delete;
+    ~BlendClient();
+
+    void LoadBackground(const char *name, const char *path, int &width, int &height);
+    void UnloadBackground(const char *name);
+    void QueryBackground(const char *name, int &width, int &height);
+    void Blend(const char *background, const SharedImage &foreground, int x, int y, SharedImage &output,
+               const BlendOptions &options = BlendOptions());      // Output must be as big as background
+    void Shutdown();
+};
+
+#endif //ALPHABLENDING_BLENDSERVER_H
@@ -0,0 +1,11 @@
+#ifndef ALPHABLENDING_BMPFORMAT_H
+#define ALPHABLENDING_BMPFORMAT_H
+
+// Layout of BMP files shared by the 32-bit and the indexed codecs
+const unsigned short BMP_SIGNATURE = 0x4d42;        // "BM" read as little-endian
+const unsigned int BMP_FILE_HEADER_SIZE = 14;
+const unsigned int BMP_INFO_HEADER_SIZE = 40;       // BITMAPINFOHEADER, the smallest info header
+const unsigned int BMP_V4_HEADER_SIZE = 108;
+const unsigned int BMP_V5_HEADER_SIZE = 124;
+
+#endif //ALPHABLENDING_BMPFORMAT_H
@@ -0,0 +1,97 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+
+/*
+ * Alpha of a pixel is (distance - tolerance) * 255 / softness clamped to [0, 255], where distance is Euclidean
+ * distance to key color. Vector and scalar paths do the same float operations in the same order, so every pixel
+ * gets the same alpha regardless of its position in the row.
+ */
+struct KeyParameters {
+    float red;
+    float green;
+    float blue;
+    float tolerance;
+    float scale;
+};
+
+static KeyParameters keyParameters(const ChromaKey &key) {
+    // Distances are square roots of integers, so the smallest non-zero (distance - tolerance) is above 1 / 1024
+    float scale = key.softness ? 255.0f / key.softness : 1e6f;
+    return {static_cast<float>(key.red), static_cast<float>(key.green), static_cast<float>(key.blue),
+            static_cast<float>(key.tolerance), scale};
+}
+
+static inline int keyAlpha(const unsigned char *pixel, const KeyParameters &key) {
+    float blue = pixel[0] - key.blue;
+    float green = pixel[1] - key.green;
+    float red = pixel[2] - key.red;
+    float distance = std::sqrt(std::fma(blue, blue, std::fma(green, green, red * red)));
+
+    return static_cast<int>(std::lrint(std::min(std::max((distance - key.tolerance) * key.scale, 0.0f), 255.0f)));
+}
+
+// Alpha of eight pixels in the lowest byte of every 32-bit element
+static inline __m256i keyWeights(__m256i frg, const KeyParameters &key) {
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+
+    __m256 blue = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(frg, byteMask)), _mm256_set1_ps(key.blue));
+    __m256 green = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(frg, 8), byteMask)),
+                                 _mm256_set1_ps(key.green));
+    __m256 red = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(frg, 16), byteMask)),
+                               _mm256_set1_ps(key.red));
+
+    __m256 distance = _mm256_sqrt_ps(_mm256_fmadd_ps(blue, blue, _mm256_fmadd_ps(green, green,
+                                                                                  _mm256_mul_ps(red, red))));
+    __m256 alpha = _mm256_mul_ps(_mm256_sub_ps(distance, _mm256_set1_ps(key.tolerance)), _mm256_set1_ps(key.scale));
+    alpha = _mm256_min_ps(_mm256_max_ps(alpha, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+
+    return _mm256_cvtps_epi32(alpha);                                // Rounds to nearest like lrint
+}
+
+static void blendKeyedRow(unsigned char *bkg, const unsigned char *frg, unsigned int count, const KeyParameters &key) {
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+        __m256i weights = keyWeights(frgPixels, key);
+
+        if (_mm256_testz_si256(weights, weights))
+            continue;                                                // Whole group is keyed out
+
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        _mm256_storeu_si256(dst, blendPixelsWithAlpha(_mm256_lddqu_si256(dst), frgPixels, spreadAlpha(weights)));
+    }
+
+    for (; xcur < count; xcur++) {
+        const unsigned char *src = frg + (xcur << 2);
+        unsigned char *pixel = bkg + (xcur << 2);
+        int alpha = keyAlpha(src, key);
+
+        for (int channel = 0; channel < 3; channel++)
+            pixel[channel] += ((src[channel] - pixel[channel]) * alpha) >> 8;
+    }
+}
+
+void BitMapImage::BlendChromaKey(const BitMapImage &foreground, const ChromaKey &key, unsigned int x, unsigned int y) {
+    requireFormat8();
+    foreground.requireFormat8();
+
+    if (x + foreground.width > static_cast<unsigned int>(width) ||
+        y + foreground.height > static_cast<unsigned int>(height))
+        throw std::runtime_error("Foreground does not fit into background");
+
+    MarkModified();
+
+    const KeyParameters parameters = keyParameters(key);
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        unsigned char *bkg = image.get() + (((static_cast<size_t>(y + ycur) * width) + x) << 2);
+        const unsigned char *frg = foreground.image.get() + ((static_cast<size_t>(ycur) * foreground.width) << 2);
+
+        blendKeyedRow(bkg, frg, foreground.width, parameters);
+    }
+}
@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "ImageCache.h"
+
+ImageCache::ImageCache(size_t budget) : budget(budget) {}
+
+void ImageCache::evict(size_t keep) {
+    while (bytes > keep && !entries.empty()) {
+        const Entry &oldest = entries.back();
+        bytes -= oldest.bytes;
+        lookup.erase(Key(oldest.path, oldest.format));
+        entries.pop_back();
+        evictions++;
+    }
+}
+
+std::shared_ptr<const BitMapImage> ImageCache::Load(const char *path, PixelFormat format) {
+    // Decoded from the same open file that was checked, a file replaced meanwhile is not cached under the old stats
+    std::unique_ptr<FILE, int (*)(FILE *)> input(fopen(path, "rb"), &fclose);
+    struct stat info = {};
+
+    if (!input || fstat(fileno(input.get()), &info) != 0)
+        throw std::runtime_error("Cannot open file");
+
+    Key key(path, format);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = lookup.find(key);
+
+        if (found != lookup.end()) {
+            Entry &entry = *found->second;
+
+            if (entry.mtimeSeconds == info.st_mtim.tv_sec && entry.mtimeNanoseconds == info.st_mtim.tv_nsec &&
+                entry.fileSize == info.st_size) {
+                entries.splice(entries.begin(), entries, found->second);
+                hits++;
+                return entry.image;
+            }
+
+            bytes -= entry.bytes;                                    // File has changed since it was decoded
+            entries.erase(found->second);
+            lookup.erase(found);
+        }
+
+        misses++;
+    }
+
+    // Decoding is done without the lock, so that slow files do not hold up hits on other ones
+    auto image = std::make_shared<const BitMapImage>(input.get(), format);
+    input.reset();
+    size_t size = static_cast<size_t>(image->Width()) * image->Height() * BitMapImage::BytesPerPixel(format);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (size > budget)
+        return image;                                                // Would evict everything, hand it out uncached
+
+    auto found = lookup.find(key);
+
+    if (found != lookup.end()) {                                     // Another thread has decoded it meanwhile
+        bytes -= found->second->bytes;
+        entries.erase(found->second);
+        lookup.erase(found);
+    }
+
+    evict(budget - size);
+    entries.push_front({path, format, info.st_mtim.tv_sec, info.st_mtim.tv_nsec, info.st_size, size, image});
+    lookup[key] = entries.begin();
+    bytes += size;
+    return image;
+}
+
+void ImageCache::SetBudget(size_t newBudget) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = newBudget;
+    evict(budget);
+}
+
+void ImageCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lookup.clear();
+    bytes = 0;
+}
+
+ImageCache::Statistics ImageCache::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {hits, misses, evictions, entries.size(), bytes};
+}
@@ -0,0 +1,65 @@
+#ifndef ALPHABLENDING_IMAGECACHE_H
+#define ALPHABLENDING_IMAGECACHE_H
+
+#include <cstddef>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include "BitMapImage.h"
+
+/*
+ * Cache of decoded images, keyed by path and pixel format. Entry is valid as long as modification time and size of the
+ * file stay the same. Images are shared and read-only, least recently used ones are dropped once decoded pixels exceed
+ * the budget, while callers still holding them keep them alive. Safe to use from several threads.
+ */
+class ImageCache {
+public:
+    struct Statistics {
+        size_t hits;
+        size_t misses;                   // Including reloads of files changed on disk
+        size_t evictions;
+        size_t entries;
+        size_t bytes;                    // Decoded pixels currently held
+    };
+
+private:
+    struct Entry {
+        std::string path;
+        PixelFormat format;
+        time_t mtimeSeconds;
+        long mtimeNanoseconds;
+        off_t fileSize;
+        size_t bytes;
+        std::shared_ptr<const BitMapImage> image;
+    };
+
+    using Key = std::pair<std::string, PixelFormat>;
+
+    mutable std::mutex mutex;
+    std::list<Entry> entries;                                        // Most recently used first
+    std::map<Key, std::list<Entry>::iterator> lookup;
+    size_t budget;
+    size_t bytes = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+
+    void evict(size_t keep);                                         // Drop old entries until bytes fit into keep
+
+public:
+    explicit ImageCache(size_t budget = static_cast<size_t>(256) << 20);
+    ImageCache(const ImageCache &other) = delete;
+    ImageCache &operator=(const ImageCache &other) = delete;
+
+    std::shared_ptr<const BitMapImage> Load(const char *path, PixelFormat format = PixelFormat::BGRA8);
+
+    void SetBudget(size_t bytes);
+    void Clear();
+    Statistics Stats() const;
+};
+
+#endif //ALPHABLENDING_IMAGECACHE_H
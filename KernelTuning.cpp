@@ -0,0 +1,274 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <cpuid.h>
+#include <sys/stat.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+#include "KernelTuning.h"
+
+using std::unique_ptr;
+
+static std::atomic<bool> calibrationEnabled{true};
+
+/*
+ * Tunable blending kernel. Unroll is number of vectors blended per iteration, PrefetchLines is how many cache lines
+ * ahead software prefetch is issued (0 disables it), TileHeight is number of rows processed together in 256-pixel
+ * wide strips (1 means plain row by row order), Aligned peels pixels until destination is 32-byte aligned and uses
+ * aligned loads and stores instead of _mm256_lddqu_si256.
+ */
+template<int Unroll, int PrefetchLines, bool Aligned>
+static inline void blendRowTuned(unsigned char *bkg, const unsigned char *frg, unsigned int count) {
+    unsigned int xcur = 0;
+
+    auto blendVector = [bkg, frg](unsigned int pos) {
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (pos << 2));
+        const __m256i *src = reinterpret_cast<const __m256i *>(frg + (pos << 2));
+
+        if (Aligned)
+            _mm256_store_si256(dst, blendPixels(_mm256_load_si256(dst), _mm256_loadu_si256(src)));
+        else
+            _mm256_storeu_si256(dst, blendPixels(_mm256_lddqu_si256(dst), _mm256_lddqu_si256(src)));
+    };
+
+    if (Aligned)
+        for (; xcur < count && (reinterpret_cast<uintptr_t>(bkg + (xcur << 2)) & 31); xcur++)
+            blendPixel(bkg + (xcur << 2), frg + (xcur << 2));
+
+    for (; xcur + 8 * Unroll <= count; xcur += 8 * Unroll) {
+        if (PrefetchLines) {
+            _mm_prefetch(reinterpret_cast<const char *>(bkg + (xcur << 2)) + PrefetchLines * 64, _MM_HINT_T0);
+            _mm_prefetch(reinterpret_cast<const char *>(frg + (xcur << 2)) + PrefetchLines * 64, _MM_HINT_T0);
+        }
+
+        for (int i = 0; i < Unroll; i++)
+            blendVector(xcur + 8 * i);
+    }
+
+    for (; xcur + 8 <= count; xcur += 8)
+        blendVector(xcur);
+
+    for (; xcur < count; xcur++)
+        blendPixel(bkg + (xcur << 2), frg + (xcur << 2));
+}
+
+template<int Unroll, int PrefetchLines, int TileHeight, bool Aligned>
+static void blendKernel(unsigned char *bkg, size_t bkgStride, const unsigned char *frg, size_t frgStride,
+                        unsigned int width, unsigned int height) {
+    const unsigned int tileWidth = TileHeight == 1 ? width : 256;
+
+    for (unsigned int ytile = 0; ytile < height; ytile += TileHeight) {
+        unsigned int rows = std::min<unsigned int>(TileHeight, height - ytile);
+
+        for (unsigned int xtile = 0; xtile < width; xtile += tileWidth) {
+            unsigned int count = std::min(tileWidth, width - xtile);
+
+            for (unsigned int row = ytile; row < ytile + rows; row++)
+                blendRowTuned<Unroll, PrefetchLines, Aligned>(bkg + row * bkgStride + (xtile << 2),
+                                                              frg + row * frgStride + (xtile << 2), count);
+        }
+    }
+}
+
+struct KernelConfig {
+    int unroll;
+    int prefetchLines;
+    int tileHeight;
+    bool aligned;
+};
+
+struct KernelVariant {
+    KernelConfig config;
+    BlendKernel kernel;
+};
+
+#define BLEND_KERNEL_VARIANT(unroll, prefetch, tile, aligned) \
+    {{unroll, prefetch, tile, aligned}, &blendKernel<unroll, prefetch, tile, aligned>}
+
+static const KernelVariant kernelVariants[] = {
+        BLEND_KERNEL_VARIANT(1, 0, 1, false),      // First one is the untuned default
+        BLEND_KERNEL_VARIANT(1, 0, 1, true),
+        BLEND_KERNEL_VARIANT(1, 0, 4, false),
+        BLEND_KERNEL_VARIANT(1, 0, 4, true),
+        BLEND_KERNEL_VARIANT(1, 8, 1, false),
+        BLEND_KERNEL_VARIANT(1, 8, 1, true),
+        BLEND_KERNEL_VARIANT(1, 8, 4, false),
+        BLEND_KERNEL_VARIANT(1, 8, 4, true),
+        BLEND_KERNEL_VARIANT(2, 0, 1, false),
+        BLEND_KERNEL_VARIANT(2, 0, 1, true),
+        BLEND_KERNEL_VARIANT(2, 0, 4, false),
+        BLEND_KERNEL_VARIANT(2, 0, 4, true),
+        BLEND_KERNEL_VARIANT(2, 8, 1, false),
+        BLEND_KERNEL_VARIANT(2, 8, 1, true),
+        BLEND_KERNEL_VARIANT(2, 8, 4, false),
+        BLEND_KERNEL_VARIANT(2, 8, 4, true),
+        BLEND_KERNEL_VARIANT(4, 0, 1, false),
+        BLEND_KERNEL_VARIANT(4, 0, 1, true),
+        BLEND_KERNEL_VARIANT(4, 0, 4, false),
+        BLEND_KERNEL_VARIANT(4, 0, 4, true),
+        BLEND_KERNEL_VARIANT(4, 8, 1, false),
+        BLEND_KERNEL_VARIANT(4, 8, 1, true),
+        BLEND_KERNEL_VARIANT(4, 8, 4, false),
+        BLEND_KERNEL_VARIANT(4, 8, 4, true),
+};
+
+#undef BLEND_KERNEL_VARIANT
+
+const size_t KERNEL_VARIANT_COUNT = sizeof(kernelVariants) / sizeof(kernelVariants[0]);
+
+// Processor brand string, tuning results are only reused on the same processor model
+static std::string cpuSignature() {
+    unsigned int brand[12] = {};
+
+    for (unsigned int leaf = 0; leaf < 3; leaf++)
+        __get_cpuid(0x80000002 + leaf, &brand[leaf * 4], &brand[leaf * 4 + 1], &brand[leaf * 4 + 2],
+                    &brand[leaf * 4 + 3]);
+
+    std::string signature(reinterpret_cast<const char *>(brand), sizeof(brand));
+    signature.resize(strnlen(signature.c_str(), sizeof(brand)));
+
+    for (char &c : signature)
+        if (c == ' ')
+            c = '_';
+
+    return signature;
+}
+
+// Location of tuning cache: ALPHABLEND_TUNE_FILE, then $XDG_CACHE_HOME, then ~/.cache
+std::string tuneFilePath() {
+    if (const char *path = getenv("ALPHABLEND_TUNE_FILE"))
+        return path;
+
+    if (const char *cacheHome = getenv("XDG_CACHE_HOME"))
+        return std::string(cacheHome) + "/alphablend.tune";
+
+    if (const char *home = getenv("HOME"))
+        return std::string(home) + "/.cache/alphablend.tune";
+
+    return ".alphablend.tune";
+}
+
+// Time every kernel variant on a synthetic unaligned blend and return index of the fastest one
+size_t calibrateKernels(bool verbose) {
+    const unsigned int bkgSide = 1024;
+    const unsigned int frgSide = 509;                 // Odd size to exercise row tails
+    const int repetitions = 15;
+
+    unique_ptr<unsigned char[], free_deleter> bkg(allocatePixels(bkgSide * bkgSide * 4));
+    unique_ptr<unsigned char[], free_deleter> frg(allocatePixels(frgSide * frgSide * 4));
+
+    for (unsigned int i = 0; i < bkgSide * bkgSide * 4; i++)
+        bkg[i] = i * 7;
+    for (unsigned int i = 0; i < frgSide * frgSide * 4; i++)
+        frg[i] = i * 13;
+
+    size_t best = 0;
+    double bestTime = 0;
+
+    for (size_t variant = 0; variant < KERNEL_VARIANT_COUNT; variant++) {
+        double fastest = 0;
+
+        for (int rep = 0; rep < repetitions; rep++) {
+            auto start = std::chrono::steady_clock::now();
+            kernelVariants[variant].kernel(bkg.get() + ((3 * bkgSide + 5) << 2), bkgSide * 4, frg.get(), frgSide * 4,
+                                           frgSide, frgSide);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            if (rep == 0 || elapsed.count() < fastest)
+                fastest = elapsed.count();
+        }
+
+        if (verbose) {
+            const KernelConfig &config = kernelVariants[variant].config;
+            printf("unroll %d prefetch %d tile %d %-9s %8.1f us\n", config.unroll, config.prefetchLines,
+                   config.tileHeight, config.aligned ? "aligned" : "lddqu", fastest * 1e6);
+        }
+
+        if (variant == 0 || fastest < bestTime) {
+            best = variant;
+            bestTime = fastest;
+        }
+    }
+
+    return best;
+}
+
+// Like mkdir -p for every directory above the file
+static void createParentDirectories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);                 // Existing ones just fail with EEXIST
+}
+
+bool saveTuning(size_t variant) {
+    const std::string path = tuneFilePath();
+    createParentDirectories(path);
+    unique_ptr<FILE, int (*)(FILE *)> output(fopen(path.c_str(), "w"), &fclose);
+
+    if (!output)
+        return false;
+
+    const KernelConfig &config = kernelVariants[variant].config;
+    fprintf(output.get(), "alphablend-tune 1 %s %d %d %d %d\n", cpuSignature().c_str(), config.unroll,
+            config.prefetchLines, config.tileHeight, config.aligned);
+    return fclose(output.release()) == 0;
+}
+
+// Returns index of cached variant or KERNEL_VARIANT_COUNT if there is no usable cache
+static size_t loadTuning() {
+    unique_ptr<FILE, int (*)(FILE *)> input(fopen(tuneFilePath().c_str(), "r"), &fclose);
+
+    if (!input)
+        return KERNEL_VARIANT_COUNT;
+
+    char signature[64] = {};
+    int version = 0;
+    KernelConfig config = {};
+    int aligned = 0;
+
+    if (fscanf(input.get(), "alphablend-tune %d %63s %d %d %d %d", &version, signature, &config.unroll,
+               &config.prefetchLines, &config.tileHeight, &aligned) != 6 || version != 1 ||
+        cpuSignature().compare(0, 63, signature) != 0)
+        return KERNEL_VARIANT_COUNT;
+
+    for (size_t variant = 0; variant < KERNEL_VARIANT_COUNT; variant++) {
+        const KernelConfig &candidate = kernelVariants[variant].config;
+
+        if (candidate.unroll == config.unroll && candidate.prefetchLines == config.prefetchLines &&
+            candidate.tileHeight == config.tileHeight && candidate.aligned == static_cast<bool>(aligned))
+            return variant;
+    }
+
+    return KERNEL_VARIANT_COUNT;
+}
+
+void setKernelCalibration(bool enabled) {
+    calibrationEnabled = enabled;
+}
+
+// Kernel used by Blend, calibrated on the first call unless tuning cache already has an answer for this processor
+BlendKernel tunedKernel() {
+    static const BlendKernel kernel = []() {
+        size_t variant = loadTuning();
+        const char *tune = getenv("ALPHABLEND_TUNE");
+
+        if (variant == KERNEL_VARIANT_COUNT && (!calibrationEnabled || (tune && !strcmp(tune, "0"))))
+            return kernelVariants[0].kernel;
+
+        if (variant == KERNEL_VARIANT_COUNT) {
+            variant = calibrateKernels(false);
+
+            // Reported once per process, next ones calibrate again until the cache can be written
+            if (!saveTuning(variant))
+                fprintf(stderr, "alphablend: cannot save kernel tuning to %s: %s\n", tuneFilePath().c_str(),
+                        strerror(errno));
+        }
+
+        return kernelVariants[variant].kernel;
+    }();
+
+    return kernel;
+}
@@ -0,0 +1,18 @@
+#ifndef ALPHABLENDING_KERNELTUNING_H
+#define ALPHABLENDING_KERNELTUNING_H
+
+#include <cstddef>
+#include <string>
+
+using BlendKernel = void (*)(unsigned char *, size_t, const unsigned char *, size_t, unsigned int, unsigned int);
+
+std::string tuneFilePath();                          // Location of tuning cache
+size_t calibrateKernels(bool verbose);               // Index of the fastest kernel variant on this machine
+bool saveTuning(size_t variant);                     // Creates missing directories, false if file cannot be written
+BlendKernel tunedKernel();                           // Kernel used by Blend for plain 8-bit composites
+
+// With calibration off the first Blend takes cached tuning or the default kernel, but never times variants itself.
+// Also turned off by ALPHABLEND_TUNE=0, has to be set before the first Blend
+void setKernelCalibration(bool enabled);
+
+#endif //ALPHABLENDING_KERNELTUNING_H
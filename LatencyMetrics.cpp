@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <strings.h>
+#include "LatencyMetrics.h"
+
+namespace {
+    // Histograms of one thread, only that thread writes them
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[LatencyMetrics::OperationCount][LatencyMetrics::bucketCount];
+        std::atomic<uint64_t> sum[LatencyMetrics::OperationCount];
+        std::atomic<uint64_t> max[LatencyMetrics::OperationCount];
+    };
+
+    // Never destroyed, threads may still record while static objects are torn down at exit
+    std::mutex &registryMutex() {
+        static std::mutex *mutex = new std::mutex();
+        return *mutex;
+    }
+
+    std::vector<Shard *> &registry() {
+        static std::vector<Shard *> *shards = new std::vector<Shard *>();
+        return *shards;
+    }
+
+    // Histograms of finished threads added up, written under registryMutex
+    Shard &retired() {
+        static Shard *shard = new Shard();
+        return *shard;
+    }
+
+    // Owner is the only writer, so a plain store is enough and no locked instruction is needed
+    inline void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // Shard of the thread, folded into retired ones and freed when the thread exits
+    struct ShardHolder {
+        Shard *shard = nullptr;
+
+        ~ShardHolder() {
+            if (!shard)
+                return;
+
+            std::lock_guard<std::mutex> lock(registryMutex());
+            Shard &total = retired();
+
+            for (unsigned int operation = 0; operation < LatencyMetrics::OperationCount; operation++) {
+                for (unsigned int bucket = 0; bucket < LatencyMetrics::bucketCount; bucket++) {
+                    uint64_t count = shard->counts[operation][bucket].load(std::memory_order_relaxed);
+                    add(total.counts[operation][bucket], count);
+                }
+
+                uint64_t max = shard->max[operation].load(std::memory_order_relaxed);
+                add(total.sum[operation], shard->sum[operation].load(std::memory_order_relaxed));
+
+                if (max > total.max[operation].load(std::memory_order_relaxed))
+                    total.max[operation].store(max, std::memory_order_relaxed);
+            }
+
+            std::vector<Shard *> &shards = registry();
+            shards.erase(std::find(shards.begin(), shards.end(), shard));
+            delete shard;
+            shard = nullptr;                                         // Recording later on makes a new one
+        }
+    };
+
+    Shard &threadShard() {
+        static thread_local ShardHolder holder;
+
+        if (!holder.shard) {
+            holder.shard = new Shard();                              // Value-initialized, so all counts are zero
+            std::lock_guard<std::mutex> lock(registryMutex());
+            registry().push_back(holder.shard);
+        }
+
+        return *holder.shard;
+    }
+
+    unsigned int bucketOf(uint64_t nanoseconds) {
+        if (nanoseconds < LatencyMetrics::subBuckets)
+            return nanoseconds;
+
+        unsigned int shift = 63 - __builtin_clzll(nanoseconds) - 4;  // 16 sub-buckets take 4 top bits
+        uint64_t bucket = (shift + 1) * LatencyMetrics::subBuckets + (nanoseconds >> shift) -
+                          LatencyMetrics::subBuckets;
+        return std::min<uint64_t>(bucket, LatencyMetrics::bucketCount - 1);
+    }
+
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+}
+
+void LatencyMetrics::Record(Operation operation, std::chrono::nanoseconds elapsed) {
+    uint64_t nanoseconds = std::max<int64_t>(elapsed.count(), 0);
+    Shard &shard = threadShard();
+
+    add(shard.counts[operation][bucketOf(nanoseconds)], 1);
+    add(shard.sum[operation], nanoseconds);
+
+    if (nanoseconds > shard.max[operation].load(std::memory_order_relaxed))
+        shard.max[operation].store(nanoseconds, std::memory_order_relaxed);
+}
+
+LatencyMetrics::Histogram LatencyMetrics::Snapshot(Operation operation) {
+    Histogram histogram = {};
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::vector<const Shard *> shards(registry().begin(), registry().end());
+    shards.push_back(&retired());
+
+    for (const Shard *shard : shards) {
+        for (unsigned int bucket = 0; bucket < bucketCount; bucket++) {
+            uint64_t count = shard->counts[operation][bucket].load(std::memory_order_relaxed);
+            histogram.counts[bucket] += count;
+            histogram.count += count;
+        }
+
+        histogram.sum += shard->sum[operation].load(std::memory_order_relaxed);
+        histogram.max = std::max(histogram.max, shard->max[operation].load(std::memory_order_relaxed));
+    }
+
+    return histogram;
+}
+
+uint64_t LatencyMetrics::BucketUpperBound(unsigned int bucket) {
+    if (bucket < subBuckets)
+        return bucket + 1;
+
+    unsigned int shift = bucket / subBuckets - 1;
+    return static_cast<uint64_t>(bucket % subBuckets + subBuckets + 1) << shift;
+}
+
+uint64_t LatencyMetrics::Histogram::Quantile(double quantile) const {
+    uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(quantile * count)), 1);
+    uint64_t seen = 0;
+
+    for (unsigned int bucket = 0; bucket < bucketCount && count; bucket++) {
+        seen += counts[bucket];
+
+        if (seen >= rank)
+            return std::min(BucketUpperBound(bucket), max);
+    }
+
+    return max;
+}
+
+const char *LatencyMetrics::Name(Operation operation) {
+    static const char *const names[OperationCount] = {"load", "blend", "save", "job"};
+    return names[operation];
+}
+
+void LatencyMetrics::WritePrometheus(FILE *output) {
+    fprintf(output, "# HELP alphablend_latency_seconds Latency of image operations.\n"
+                    "# TYPE alphablend_latency_seconds histogram\n");
+
+    std::vector<Histogram> histograms;
+
+    for (int operation = 0; operation < OperationCount; operation++)
+        histograms.push_back(Snapshot(static_cast<Operation>(operation)));
+
+    for (int operation = 0; operation < OperationCount; operation++) {
+        const Histogram &histogram = histograms[operation];
+        const char *name = Name(static_cast<Operation>(operation));
+        uint64_t cumulative = 0;
+        unsigned int bucket = 0;
+
+        // Coarse buckets at powers of two from 1 us to 68 s, every one of them is an edge of fine buckets
+        for (int power = 10; power <= 36; power++) {
+            for (; bucket < bucketCount && BucketUpperBound(bucket) <= (static_cast<uint64_t>(1) << power); bucket++)
+                cumulative += histogram.counts[bucket];
+
+            fprintf(output, "alphablend_latency_seconds_bucket{operation=\"%s\",le=\"%.10g\"} %llu\n", name,
+                    static_cast<double>(static_cast<uint64_t>(1) << power) * 1e-9,
+                    static_cast<unsigned long long>(cumulative));
+        }
+
+        fprintf(output, "alphablend_latency_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n", name,
+                static_cast<unsigned long long>(histogram.count));
+        fprintf(output, "alphablend_latency_seconds_sum{operation=\"%s\"} %.9f\n", name, histogram.sum * 1e-9);
+        fprintf(output, "alphablend_latency_seconds_count{operation=\"%s\"} %llu\n", name,
+                static_cast<unsigned long long>(histogram.count));
+    }
+
+    fprintf(output, "# HELP alphablend_latency_quantile_seconds Latency quantiles from the histograms.\n"
+                    "# TYPE alphablend_latency_quantile_seconds gauge\n");
+
+    for (int operation = 0; operation < OperationCount; operation++) {
+        const Histogram &histogram = histograms[operation];
+
+        for (double quantile : quantiles)
+            fprintf(output, "alphablend_latency_quantile_seconds{operation=\"%s\",quantile=\"%g\"} %.9f\n",
+                    Name(static_cast<Operation>(operation)), quantile, histogram.Quantile(quantile) * 1e-9);
+
+        fprintf(output, "alphablend_latency_quantile_seconds{operation=\"%s\",quantile=\"1\"} %.9f\n",
+                Name(static_cast<Operation>(operation)), histogram.max * 1e-9);
+    }
+}
+
+void LatencyMetrics::WriteJson(FILE *output) {
+    fprintf(output, "{");
+
+    for (int operation = 0; operation < OperationCount; operation++) {
+        const Histogram histogram = Snapshot(static_cast<Operation>(operation));
+
+        fprintf(output, "%s\n  \"%s\": {\"count\": %llu, \"sum_seconds\": %.9f, \"max_seconds\": %.9f",
+                operation ? "," : "", Name(static_cast<Operation>(operation)),
+                static_cast<unsigned long long>(histogram.count), histogram.sum * 1e-9, histogram.max * 1e-9);
+
+        for (double quantile : quantiles)
+            fprintf(output, ", \"p%g\": %.9f", quantile * 100, histogram.Quantile(quantile) * 1e-9);
+
+        // Only buckets with something in them, as pairs of upper bound in seconds and count
+        fprintf(output, ",\n    \"buckets\": [");
+        bool first = true;
+
+        for (unsigned int bucket = 0; bucket < bucketCount; bucket++) {
+            if (!histogram.counts[bucket])
+                continue;
+
+            fprintf(output, "%s[%.9g, %llu]", first ? "" : ", ", BucketUpperBound(bucket) * 1e-9,
+                    static_cast<unsigned long long>(histogram.counts[bucket]));
+            first = false;
+        }
+
+        fprintf(output, "]}");
+    }
+
+    fprintf(output, "\n}\n");
+}
+
+void LatencyMetrics::Dump(const char *path) {
+    std::string temporary = std::string(path) + ".tmp";
+    std::unique_ptr<FILE, int (*)(FILE *)> output(fopen(temporary.c_str(), "w"), &fclose);
+
+    if (!output)
+        throw std::runtime_error("Cannot create file");
+
+    size_t nameLength = strlen(path);
+
+    if (nameLength > 5 && !strcasecmp(path + nameLength - 5, ".json"))
+        WriteJson(output.get());
+    else
+        WritePrometheus(output.get());
+
+    // Readers see either the previous dump or the whole new one
+    if (fclose(output.release()) != 0 || rename(temporary.c_str(), path) != 0)
+        throw std::runtime_error("Cannot write file");
+}
+
+MetricsDump::MetricsDump(const char *path, unsigned int intervalSeconds) : path(path),
+                                                                           interval(std::max(intervalSeconds, 1u)) {
+    writer = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!wakeup.wait_for(lock, std::chrono::seconds(interval), [this]() { return stopping; })) {
+            try {
+                LatencyMetrics::Dump(this->path.c_str());
+            } catch (const std::exception &error) {
+                fprintf(stderr, "%s: %s\n", this->path.c_str(), error.what());
+            }
+        }
+    });
+}
+
+MetricsDump::~MetricsDump() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    wakeup.notify_one();
+    writer.join();
+
+    try {
+        LatencyMetrics::Dump(path.c_str());
+    } catch (const std::exception &error) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), error.what());
+    }
+}
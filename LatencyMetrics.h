@@ -0,0 +1,82 @@
+#ifndef ALPHABLENDING_LATENCYMETRICS_H
+#define ALPHABLENDING_LATENCYMETRICS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * Always-on latency histograms of image operations. Buckets are log-linear like in HdrHistogram: every power of two
+ * is cut into 16 equal buckets, so recorded times are within 6.25% of the truth from nanoseconds to hours. Every
+ * thread records into histograms of its own with plain relaxed stores, readers add histograms of all threads up, so
+ * recording takes no lock and shares no cache line. Histograms of a finished thread are added to common ones and
+ * freed, totals never go down.
+ */
+class LatencyMetrics {
+public:
+    enum Operation {
+        Load,                            // Decoding a file into an image
+        Blend,                           // One Blend of 4096 pixels or more, pools count their whole call
+        Save,                            // Encoding and writing a file
+        Job,                             // Whole job of batch or server, including all of the above
+        OperationCount
+    };
+
+    static const unsigned int subBuckets = 16;                       // Per power of two
+    static const unsigned int bucketCount = 41 * subBuckets;         // Up to 2^44 ns, longer times go to the last one
+
+    struct Histogram {
+        uint64_t counts[bucketCount];
+        uint64_t count;
+        uint64_t sum;                                                // Nanoseconds
+        uint64_t max;
+
+        uint64_t Quantile(double quantile) const;                    // Upper bound of the bucket, in nanoseconds
+    };
+
+    // Measures time from construction to destruction
+    class Timer {
+    private:
+        Operation operation;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit Timer(Operation operation) : operation(operation), start(std::chrono::steady_clock::now()) {}
+        Timer(const Timer &other) = delete;
+        Timer &operator=(const Timer &other) = delete;
+        ~Timer() { Record(operation, std::chrono::steady_clock::now() - start); }
+    };
+
+    static void Record(Operation operation, std::chrono::nanoseconds elapsed);
+    static Histogram Snapshot(Operation operation);                  // Sum over all threads
+    static const char *Name(Operation operation);
+
+    static uint64_t BucketUpperBound(unsigned int bucket);           // Exclusive, in nanoseconds
+
+    static void WritePrometheus(FILE *output);                       // Prometheus text exposition format
+    static void WriteJson(FILE *output);
+    static void Dump(const char *path);                              // JSON for names ending with .json, else text
+};
+
+// Writes metrics to a file every few seconds and once more when destroyed
+class MetricsDump {
+private:
+    std::string path;
+    unsigned int interval;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread writer;
+
+public:
+    MetricsDump(const char *path, unsigned int intervalSeconds);
+    MetricsDump(const MetricsDump &other) = delete;
+    MetricsDump &operator=(const MetricsDump &other) = delete;
+    ~MetricsDump();
+};
+
+#endif //ALPHABLENDING_LATENCYMETRICS_H
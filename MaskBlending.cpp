@@ -0,0 +1,107 @@
+#include <stdexcept>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+
+// Coverage of eight pixels, scaled by opacity + 1 when Modulated, in the lowest byte of every 32-bit element
+template<bool Modulated>
+static inline __m256i maskWeights(const unsigned char *mask, __m256i opacity) {
+    __m256i weights = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask)));
+
+    if (Modulated)
+        weights = _mm256_srli_epi32(_mm256_mullo_epi16(weights, opacity), 8);     // Products fit into low 16 bits
+
+    return weights;
+}
+
+template<bool Modulated>
+static void blendMaskRow(unsigned char *bkg, const unsigned char *mask, unsigned int count, const Color &color) {
+    const __m256i colorVector = _mm256_set1_epi32(color.blue | color.green << 8 | color.red << 16);
+    const __m256i opacity = _mm256_set1_epi32(color.alpha + 1);
+    const int channels[3] = {color.blue, color.green, color.red};
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i weights = maskWeights<Modulated>(mask + xcur, opacity);
+
+        if (_mm256_testz_si256(weights, weights))
+            continue;                                                // Nothing covered, common around glyphs
+
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        _mm256_storeu_si256(dst, blendPixelsWithAlpha(_mm256_lddqu_si256(dst), colorVector, spreadAlpha(weights)));
+    }
+
+    for (; xcur < count; xcur++) {
+        int alpha = Modulated ? (mask[xcur] * (color.alpha + 1)) >> 8 : mask[xcur];
+        unsigned char *pixel = bkg + (xcur << 2);
+
+        for (int channel = 0; channel < 3; channel++)
+            pixel[channel] += ((channels[channel] - pixel[channel]) * alpha) >> 8;
+    }
+}
+
+static void blendMaskedRow(unsigned char *bkg, const unsigned char *frg, const unsigned char *mask,
+                           unsigned int count) {
+    const __m256i one = _mm256_set1_epi32(1);
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i coverage = _mm256_add_epi32(maskWeights<false>(mask + xcur, one), one);
+        __m256i frgPixels = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg + (xcur << 2)));
+        __m256i weights = _mm256_srli_epi32(_mm256_mullo_epi16(_mm256_srli_epi32(frgPixels, 24), coverage), 8);
+
+        if (_mm256_testz_si256(weights, weights))
+            continue;
+
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        _mm256_storeu_si256(dst, blendPixelsWithAlpha(_mm256_lddqu_si256(dst), frgPixels, spreadAlpha(weights)));
+    }
+
+    for (; xcur < count; xcur++) {
+        int alpha = (frg[(xcur << 2) + 3] * (mask[xcur] + 1)) >> 8;
+        unsigned char *pixel = bkg + (xcur << 2);
+
+        for (int channel = 0; channel < 3; channel++)
+            pixel[channel] += ((frg[(xcur << 2) + channel] - pixel[channel]) * alpha) >> 8;
+    }
+}
+
+void BitMapImage::BlendMask(const AlphaMask &mask, Color color, unsigned int x, unsigned int y) {
+    requireFormat8();
+
+    if (x + mask.width > static_cast<unsigned int>(width) || y + mask.height > static_cast<unsigned int>(height))
+        throw std::runtime_error("Mask does not fit into background");
+
+    MarkModified();
+
+    for (int ycur = 0; ycur < mask.height; ycur++) {
+        unsigned char *bkg = image.get() + (((static_cast<size_t>(y + ycur) * width) + x) << 2);
+        const unsigned char *row = mask.alpha + static_cast<size_t>(ycur) * mask.width;
+
+        if (color.alpha == 255)
+            blendMaskRow<false>(bkg, row, mask.width, color);
+        else
+            blendMaskRow<true>(bkg, row, mask.width, color);
+    }
+}
+
+void BitMapImage::BlendMasked(const BitMapImage &foreground, const AlphaMask &mask, unsigned int x, unsigned int y) {
+    requireFormat8();
+    foreground.requireFormat8();
+
+    if (mask.width != foreground.width || mask.height != foreground.height)
+        throw std::runtime_error("Mask must have the size of foreground");
+
+    if (x + foreground.width > static_cast<unsigned int>(width) ||
+        y + foreground.height > static_cast<unsigned int>(height))
+        throw std::runtime_error("Foreground does not fit into background");
+
+    MarkModified();
+
+    for (int ycur = 0; ycur < foreground.height; ycur++) {
+        unsigned char *bkg = image.get() + (((static_cast<size_t>(y + ycur) * width) + x) << 2);
+        const unsigned char *frg = foreground.image.get() + ((static_cast<size_t>(ycur) * foreground.width) << 2);
+
+        blendMaskedRow(bkg, frg, mask.alpha + static_cast<size_t>(ycur) * mask.width, foreground.width);
+    }
+}
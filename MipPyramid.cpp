@@ -0,0 +1,148 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <immintrin.h>
+#include "MipPyramid.h"
+
+// Rounded average of 2x2 blocks of eight pixels from two rows, gives four pixels
+static inline __m128i averageBlocks(const unsigned char *row0, const unsigned char *row1) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    __m256i top = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(row0));
+    __m256i bottom = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(row1));
+
+    // Pixels 0, 1 and 4, 5 in low halves, 2, 3 and 6, 7 in high halves
+    __m256i low = _mm256_add_epi16(_mm256_unpacklo_epi8(top, zeroes), _mm256_unpacklo_epi8(bottom, zeroes));
+    __m256i high = _mm256_add_epi16(_mm256_unpackhi_epi8(top, zeroes), _mm256_unpackhi_epi8(bottom, zeroes));
+
+    low = _mm256_add_epi16(low, _mm256_srli_si256(low, 8));
+    high = _mm256_add_epi16(high, _mm256_srli_si256(high, 8));
+
+    __m256i sums = _mm256_unpacklo_epi64(low, high);
+    sums = _mm256_srli_epi16(_mm256_add_epi16(sums, _mm256_set1_epi16(2)), 2);
+
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(sums, sums), 0x08));
+}
+
+// Even and odd pixels of sixteen in a row, each in their order
+static inline void splitPixels(const unsigned char *row, __m256i &even, __m256i &odd) {
+    __m256 first = _mm256_loadu_ps(reinterpret_cast<const float *>(row));
+    __m256 second = _mm256_loadu_ps(reinterpret_cast<const float *>(row + 32));
+
+    even = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(first, second, 0x88)), 0xD8);
+    odd = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(first, second, 0xDD)), 0xD8);
+}
+
+// Colors weighted by alpha, blocks without any alpha fall back to plain average of colors
+static inline __m256i averageBlocksWeighted(const unsigned char *row0, const unsigned char *row1) {
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i two = _mm256_set1_epi32(2);
+    __m256i pixels[4];
+
+    splitPixels(row0, pixels[0], pixels[1]);
+    splitPixels(row1, pixels[2], pixels[3]);
+
+    __m256i alphaSum = _mm256_setzero_si256();
+    __m256i weighted[3] = {alphaSum, alphaSum, alphaSum};
+    __m256i plain[3] = {alphaSum, alphaSum, alphaSum};
+
+    for (__m256i pixel : pixels) {
+        __m256i alpha = _mm256_srli_epi32(pixel, 24);
+        alphaSum = _mm256_add_epi32(alphaSum, alpha);
+
+        for (int channel = 0; channel < 3; channel++) {
+            __m256i value = _mm256_and_si256(_mm256_srli_epi32(pixel, channel * 8), byteMask);
+            weighted[channel] = _mm256_add_epi32(weighted[channel], _mm256_mullo_epi32(value, alpha));
+            plain[channel] = _mm256_add_epi32(plain[channel], value);
+        }
+    }
+
+    __m256 divisor = _mm256_cvtepi32_ps(alphaSum);
+    __m256i transparent = _mm256_cmpeq_epi32(alphaSum, _mm256_setzero_si256());
+    __m256i result = _mm256_slli_epi32(_mm256_srli_epi32(_mm256_add_epi32(alphaSum, two), 2), 24);
+
+    for (int channel = 0; channel < 3; channel++) {
+        __m256i value = _mm256_cvtps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(weighted[channel]), divisor));
+        value = _mm256_blendv_epi8(value, _mm256_srli_epi32(_mm256_add_epi32(plain[channel], two), 2), transparent);
+        result = _mm256_or_si256(result, _mm256_slli_epi32(value, channel * 8));
+    }
+
+    return result;
+}
+
+// Same as the vector versions for one block of up to four distinct pixels
+static inline void averageBlock(const unsigned char *const block[4], unsigned char *dst, bool alphaWeighted) {
+    int alphaSum = 0;
+
+    for (int i = 0; i < 4; i++)
+        alphaSum += block[i][3];
+
+    for (int channel = 0; channel < 3; channel++) {
+        int weighted = 0;
+        int plain = 0;
+
+        for (int i = 0; i < 4; i++) {
+            weighted += block[i][channel] * block[i][3];
+            plain += block[i][channel];
+        }
+
+        if (alphaWeighted && alphaSum)
+            dst[channel] = static_cast<unsigned char>(std::lrint(static_cast<float>(weighted) /
+                                                                 static_cast<float>(alphaSum)));
+        else
+            dst[channel] = (plain + 2) >> 2;
+    }
+
+    dst[3] = (alphaSum + 2) >> 2;
+}
+
+void MipPyramid::Halve(const BitMapImage &src, BitMapImage &dst, bool alphaWeighted) {
+    if (src.Format() != PixelFormat::BGRA8 || dst.Format() != PixelFormat::BGRA8)
+        throw std::runtime_error("Mip pyramid needs 8-bit image");
+
+    if (dst.Width() != (src.Width() + 1) / 2 || dst.Height() != (src.Height() + 1) / 2)
+        throw std::runtime_error("Halved image must be half the size of source, rounded up");
+
+    const int width = src.Width();
+    const int halfWidth = dst.Width();
+    const int fullBlocks = width / 2;
+
+    for (int ycur = 0; ycur < dst.Height(); ycur++) {
+        const unsigned char *row0 = src.Pixels() + static_cast<size_t>(2 * ycur) * width * 4;
+        const unsigned char *row1 = 2 * ycur + 1 < src.Height() ? row0 + static_cast<size_t>(width) * 4 : row0;
+        unsigned char *out = dst.Pixels() + static_cast<size_t>(ycur) * halfWidth * 4;
+        int xcur = 0;
+
+        for (; xcur + 8 <= fullBlocks; xcur += 8) {
+            size_t offset = static_cast<size_t>(xcur) * 8;
+            __m256i *target = reinterpret_cast<__m256i *>(out + xcur * 4);
+
+            if (alphaWeighted) {
+                _mm256_storeu_si256(target, averageBlocksWeighted(row0 + offset, row1 + offset));
+            } else {
+                _mm256_storeu_si256(target, _mm256_set_m128i(averageBlocks(row0 + offset + 32, row1 + offset + 32),
+                                                             averageBlocks(row0 + offset, row1 + offset)));
+            }
+        }
+
+        for (; xcur < halfWidth; xcur++) {
+            int left = 2 * xcur;
+            int right = std::min(left + 1, width - 1);
+            const unsigned char *block[4] = {row0 + left * 4, row0 + right * 4, row1 + left * 4, row1 + right * 4};
+
+            averageBlock(block, out + xcur * 4, alphaWeighted);
+        }
+    }
+}
+
+MipPyramid::MipPyramid(const BitMapImage &image, unsigned int count, bool alphaWeighted) : base(image) {
+    if (image.Format() != PixelFormat::BGRA8)
+        throw std::runtime_error("Mip pyramid needs 8-bit image");
+
+    const BitMapImage *previous = &image;
+
+    for (unsigned int level = 0; level < count && (previous->Width() > 1 || previous->Height() > 1); level++) {
+        levels.emplace_back(new BitMapImage((previous->Width() + 1) / 2, (previous->Height() + 1) / 2));
+        Halve(*previous, *levels.back(), alphaWeighted);
+        previous = levels.back().get();
+    }
+}
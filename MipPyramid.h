@@ -0,0 +1,31 @@
+#ifndef ALPHABLENDING_MIPPYRAMID_H
+#define ALPHABLENDING_MIPPYRAMID_H
+
+#include <memory>
+#include <vector>
+#include "BitMapImage.h"
+
+/*
+ * Chain of images, each half the size of the previous one, built straight from a picture in memory. Every pixel is
+ * the rounded average of a 2x2 block, odd last column or row is averaged with itself. Alpha-weighted version averages
+ * colors weighted by their alpha, so transparent pixels do not darken edges, and keeps plain average for alpha.
+ * Level 0 is the picture itself, which has to outlive the pyramid. Only 8-bit images are supported.
+ */
+class MipPyramid {
+private:
+    const BitMapImage &base;
+    std::vector<std::unique_ptr<BitMapImage>> levels;               // Levels from 1 on
+
+public:
+    // Builds given number of levels below the picture, stops earlier at 1x1
+    MipPyramid(const BitMapImage &image, unsigned int count, bool alphaWeighted = false);
+    MipPyramid(const MipPyramid &other) = delete;
+    MipPyramid &operator=(const MipPyramid &other) = delete;
+
+    const BitMapImage &Level(unsigned int level) const { return level ? *levels[level - 1] : base; }
+    unsigned int Count() const { return levels.size() + 1; }           // Including level 0
+
+    static void Halve(const BitMapImage &src, BitMapImage &dst, bool alphaWeighted = false);
+};
+
+#endif //ALPHABLENDING_MIPPYRAMID_H
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sched.h>
+#include <unistd.h>
+#include "NumaPool.h"
+#include "LatencyMetrics.h"
+
+// Parses kernel CPU lists such as "0-3,8-11"
+static std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+
+    while (std::getline(ranges, range, ',')) {
+        int first = 0;
+        int last = 0;
+        int parsed = sscanf(range.c_str(), "%d-%d", &first, &last);
+
+        if (parsed < 1)
+            continue;
+
+        for (int cpu = first; cpu <= (parsed == 2 ? last : first); cpu++)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    }
+
+    if (cpus.empty())
+        cpus.push_back(0);
+
+    return cpus;
+}
+
+NumaTopology NumaTopology::Simulated(unsigned int count) {
+    std::vector<int> cpus = allowedCpus();
+    NumaTopology topology;
+    count = std::max(count, 1u);
+    topology.nodes.resize(count);
+
+    if (cpus.size() < count) {
+        for (unsigned int node = 0; node < count; node++)
+            topology.nodes[node].push_back(cpus[node % cpus.size()]);
+
+        return topology;
+    }
+
+    for (size_t i = 0; i < cpus.size(); i++)
+        topology.nodes[i * count / cpus.size()].push_back(cpus[i]);
+
+    return topology;
+}
+
+NumaTopology NumaTopology::Detect() {
+    const char *simulated = getenv("ALPHABLEND_NUMA_NODES");
+
+    if (simulated)
+        return Simulated(strtoul(simulated, nullptr, 10));
+
+    NumaTopology topology;
+    std::string online;
+    std::ifstream("/sys/devices/system/node/online") >> online;
+
+    for (int node : parseCpuList(online)) {
+        std::string list;
+        std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist") >> list;
+        std::vector<int> cpus = parseCpuList(list);
+
+        if (!cpus.empty())                                           // Nodes with memory only get no workers
+            topology.nodes.push_back(cpus);
+    }
+
+    if (topology.nodes.empty())
+        return Simulated(1);
+
+    return topology;
+}
+
+NumaPool::NumaPool(const NumaTopology &topology) {
+    for (const std::vector<int> &cpus : topology.nodes) {
+        threads.push_back(std::max<unsigned int>(cpus.size(), 1));
+        pools.emplace_back(new ThreadPool(threads.back(), cpus));
+    }
+
+    if (pools.empty()) {
+        threads.push_back(1);
+        pools.emplace_back(new ThreadPool(1));
+    }
+}
+
+void NumaPool::Submit(unsigned int node, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+
+    pools[node % pools.size()]->Submit([this, task = std::move(task)]() {
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (--pending == 0)
+            idle.notify_all();
+    });
+}
+
+void NumaPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return pending == 0; });
+}
+
+void NumaPool::runBands(size_t length, size_t first, size_t last, size_t alignment, size_t minPiece,
+                        const std::function<void(size_t, size_t)> &task) {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = 0;
+    std::exception_ptr failure;
+
+    for (unsigned int node = 0; node < pools.size(); node++) {
+        size_t bandBegin = length * node / pools.size() / alignment * alignment;
+        size_t bandEnd = node + 1 == pools.size() ? length : length * (node + 1) / pools.size() / alignment * alignment;
+        size_t begin = std::max(first, bandBegin);
+        size_t end = std::min(last, bandEnd);
+
+        if (begin >= end)
+            continue;
+
+        size_t pieces = std::min<size_t>(threads[node], std::max<size_t>((end - begin) / minPiece, 1));
+
+        for (size_t piece = 0; piece < pieces; piece++) {
+            size_t pieceBegin = begin + (end - begin) * piece / pieces;
+            size_t pieceEnd = begin + (end - begin) * (piece + 1) / pieces;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                remaining++;
+            }
+
+            pools[node]->Submit([&, pieceBegin, pieceEnd]() {
+                std::exception_ptr error;
+
+                try {
+                    task(pieceBegin, pieceEnd);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (error && !failure)
+                    failure = error;
+
+                if (--remaining == 0)
+                    done.notify_one();
+            });
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return remaining == 0; });
+
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+void NumaPool::Place(BitMapImage &image) {
+    const size_t size = static_cast<size_t>(image.width) * image.height * BitMapImage::BytesPerPixel(image.format);
+
+    if (size == 0)
+        return;
+
+    // Pages of a new mapping go to the node of the first worker writing them. Bands are cut at page boundaries, so no
+    // page is shared by two nodes, less than a row and a page away from the rows Blend gives to the node
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    std::unique_ptr<unsigned char[], pixel_deleter> placed(mapPixels(size));
+    placed.get_deleter().mapped = size;
+    const unsigned char *source = image.image.get();
+
+    runBands(size, 0, size, pageSize, 64 * pageSize, [&](size_t begin, size_t end) {
+        memcpy(placed.get() + begin, source + begin, end - begin);
+    });
+
+    image.image = std::move(placed);
+}
+
+void NumaPool::Blend(BitMapImage &background, const BitMapImage &foreground, unsigned int x, unsigned int y,
+                     const BlendOptions &options) {
+    if (background.format != foreground.format)
+        throw std::runtime_error("Pixel formats of images must match");
+
+    // Whole call is one blend, bands are not timed on their own
+    std::optional<LatencyMetrics::Timer> timer;
+
+    if (static_cast<size_t>(foreground.width) * foreground.height >= BitMapImage::timedBlendPixels)
+        timer.emplace(LatencyMetrics::Blend);
+
+    background.MarkModified();
+    const size_t rowSize = static_cast<size_t>(foreground.width) * BitMapImage::BytesPerPixel(foreground.format);
+    const size_t last = std::min<size_t>(static_cast<size_t>(y) + foreground.height, background.height);
+
+    unsigned char *pixels = const_cast<unsigned char *>(foreground.Pixels());
+
+    // Pieces of at least 64 rows, so that handing them over is paid off
+    runBands(background.height, y, last, 1, 64, [&](size_t begin, size_t end) {
+        // Rows of foreground landing on the piece, borrowed without copying
+        BitMapImage rows(foreground.width, end - begin, pixels + (begin - y) * rowSize, foreground.format);
+        background.blend(rows, x, begin, options);
+    });
+}
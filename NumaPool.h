@@ -0,0 +1,57 @@
+#ifndef ALPHABLENDING_NUMAPOOL_H
+#define ALPHABLENDING_NUMAPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "BitMapImage.h"
+#include "ThreadPool.h"
+
+// CPUs of every memory node
+struct NumaTopology {
+    std::vector<std::vector<int>> nodes;
+
+    // Nodes from /sys/devices/system/node, ALPHABLEND_NUMA_NODES environment variable overrides them with simulated ones
+    static NumaTopology Detect();
+    // CPUs available to the process split into given number of nodes, nodes share CPUs if there are too few of them
+    static NumaTopology Simulated(unsigned int count);
+};
+
+/*
+ * Thread pool with workers of every node pinned to CPUs of that node. Images are cut into as many bands of rows as
+ * there are nodes, band i belongs to node i. Place moves pixels into memory first touched by workers of the owning
+ * node, so the kernel puts every band on its node, and Blend hands rows of every band only to workers of that node,
+ * so they never pull pixels across the interconnect. Whole jobs may be routed with Submit to the node which loads and
+ * keeps their data. With simulated topology nothing moves between memory nodes, only threads are pinned.
+ */
+class NumaPool {
+private:
+    std::mutex mutex;                                                // Declared before pools, which use it until joined
+    std::condition_variable idle;
+    size_t pending = 0;                                              // Submitted jobs not finished yet
+    std::vector<std::unique_ptr<ThreadPool>> pools;
+    std::vector<unsigned int> threads;                               // Workers of every node
+
+    // Calls task for pieces of first to last of length units, rows or bytes, in bands of every node on workers of that
+    // node and waits for them. Bands start at multiples of alignment, pieces have at least minPiece units
+    void runBands(size_t length, size_t first, size_t last, size_t alignment, size_t minPiece,
+                  const std::function<void(size_t begin, size_t end)> &task);
+
+public:
+    explicit NumaPool(const NumaTopology &topology = NumaTopology::Detect());
+    NumaPool(const NumaPool &other) = delete;
+    NumaPool &operator=(const NumaPool &other) = delete;
+    ~NumaPool() = default;                                           // Finishes queued jobs of every node
+
+    unsigned int Nodes() const { return pools.size(); }
+    void Submit(unsigned int node, std::function<void()> task);     // Run job on workers of the node
+    void Wait();                                                     // Until all submitted jobs are finished
+
+    void Place(BitMapImage &image);                                  // Put every band of rows on its node
+    void Blend(BitMapImage &background, const BitMapImage &foreground, unsigned int x, unsigned int y,
+               const BlendOptions &options = BlendOptions());        // Blend every band on workers of its node
+};
+
+#endif //ALPHABLENDING_NUMAPOOL_H
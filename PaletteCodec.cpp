@@ -0,0 +1,169 @@
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "BmpFormat.h"
+
+/*
+ * Indexed BMP files, 4 or 8 bits per pixel with a color table of BGRX entries right after the info header. Rows are
+ * padded to 4 bytes. Indices are expanded to 32-bit pixels on load: palettes of up to 16 colors are split into four
+ * byte tables and looked up 32 pixels at a time with vpshufb, bigger ones are read with gathers. BMP palettes have
+ * no alpha, unless some entry has non-zero reserved byte, in which case reserved bytes are taken as alpha.
+ */
+
+// Interleaves four byte planes of 32 pixels into BGRA pixels and stores them
+static inline void storePlanes(unsigned int *dst, __m256i blue, __m256i green, __m256i red, __m256i alpha) {
+    __m256i blueGreenLow = _mm256_unpacklo_epi8(blue, green);
+    __m256i blueGreenHigh = _mm256_unpackhi_epi8(blue, green);
+    __m256i redAlphaLow = _mm256_unpacklo_epi8(red, alpha);
+    __m256i redAlphaHigh = _mm256_unpackhi_epi8(red, alpha);
+
+    __m256i pixels0 = _mm256_unpacklo_epi16(blueGreenLow, redAlphaLow);      // Pixels 0-3 and 16-19
+    __m256i pixels1 = _mm256_unpackhi_epi16(blueGreenLow, redAlphaLow);      // Pixels 4-7 and 20-23
+    __m256i pixels2 = _mm256_unpacklo_epi16(blueGreenHigh, redAlphaHigh);    // Pixels 8-11 and 24-27
+    __m256i pixels3 = _mm256_unpackhi_epi16(blueGreenHigh, redAlphaHigh);    // Pixels 12-15 and 28-31
+
+    __m256i *out = reinterpret_cast<__m256i *>(dst);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(pixels0, pixels1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(pixels2, pixels3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(pixels0, pixels1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(pixels2, pixels3, 0x31));
+}
+
+class PaletteExpander {
+private:
+    alignas(32) unsigned int palette[256] = {};                      // Entries past the color table stay transparent
+    __m256i planes[4];                                               // Byte tables of the first 16 entries
+    bool small;
+
+    inline void lookup(__m256i indices, unsigned int *dst) const {
+        storePlanes(dst, _mm256_shuffle_epi8(planes[0], indices), _mm256_shuffle_epi8(planes[1], indices),
+                    _mm256_shuffle_epi8(planes[2], indices), _mm256_shuffle_epi8(planes[3], indices));
+    }
+
+    inline void gather(__m256i indices, unsigned int *dst) const {
+        const int *table = reinterpret_cast<const int *>(palette);
+        __m128i low = _mm256_castsi256_si128(indices);
+        __m128i high = _mm256_extracti128_si256(indices, 1);
+
+        __m256i *out = reinterpret_cast<__m256i *>(dst);
+        _mm256_storeu_si256(out, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(low), 4));
+        _mm256_storeu_si256(out + 1, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)), 4));
+        _mm256_storeu_si256(out + 2, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(high), 4));
+        _mm256_storeu_si256(out + 3, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)), 4));
+    }
+
+public:
+    PaletteExpander(const unsigned char *entries, unsigned int count) : small(count <= 16) {
+        bool hasAlpha = false;
+
+        for (unsigned int i = 0; i < count; i++)
+            hasAlpha |= entries[i * 4 + 3] != 0;
+
+        for (unsigned int i = 0; i < count; i++) {
+            memcpy(palette + i, entries + i * 4, 4);
+
+            if (!hasAlpha)
+                palette[i] |= 0xff000000;
+        }
+
+        alignas(32) unsigned char bytes[4][32];
+
+        for (int channel = 0; channel < 4; channel++) {
+            for (int i = 0; i < 32; i++)
+                bytes[channel][i] = palette[i & 15] >> (channel * 8);
+
+            planes[channel] = _mm256_load_si256(reinterpret_cast<const __m256i *>(bytes[channel]));
+        }
+    }
+
+    void Expand8(const unsigned char *src, unsigned int *dst, int count) const {
+        const __m256i limit = _mm256_set1_epi8(15);
+        int x = 0;
+
+        for (; x + 32 <= count; x += 32) {
+            __m256i indices = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x));
+
+            // vpshufb only sees low 4 bits, so a stray bigger index sends the whole group through gathers
+            if (small && _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(indices, limit), limit)) == -1)
+                lookup(indices, dst + x);
+            else
+                gather(indices, dst + x);
+        }
+
+        for (; x < count; x++)
+            dst[x] = palette[src[x]];
+    }
+
+    // Two pixels per byte, the first one in the high nibble; the palette has at most 16 entries here
+    void Expand4(const unsigned char *src, unsigned int *dst, int count) const {
+        const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+        int x = 0;
+
+        for (; x + 32 <= count; x += 32) {
+            __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x / 2));
+            __m128i first = _mm_and_si128(_mm_srli_epi16(packed, 4), nibbleMask);
+            __m128i second = _mm_and_si128(packed, nibbleMask);
+
+            lookup(_mm256_set_m128i(_mm_unpackhi_epi8(first, second), _mm_unpacklo_epi8(first, second)), dst + x);
+        }
+
+        for (; x < count; x++)
+            dst[x] = palette[(x & 1) ? src[x / 2] & 0x0f : src[x / 2] >> 4];
+    }
+};
+
+void BitMapImage::loadIndexed(FILE *input) {
+    if (bitCount != 4 && bitCount != 8)
+        throw std::runtime_error("Only 4 and 8-bit indexed images are supported");
+
+    if (compression != 0)
+        throw std::runtime_error("Compressed indexed images are not supported");
+
+    unsigned int maxColors = 1u << bitCount;
+    unsigned int colors = clrUsed ? clrUsed : maxColors;
+
+    // Color table follows the info header and has to end before pixels, INT_MIN has no absolute value
+    const size_t tableOffset = static_cast<size_t>(BMP_FILE_HEADER_SIZE) + structSize;
+
+    if (colors > maxColors || width <= 0 || height == 0 || height == INT_MIN || structSize < BMP_INFO_HEADER_SIZE ||
+        tableOffset + static_cast<size_t>(colors) * 4 > offBits ||
+        static_cast<size_t>(width) * std::abs(height) > (static_cast<size_t>(1) << 30))
+        throw std::runtime_error("Invalid indexed image header");
+
+    unsigned char entries[256 * 4] = {};
+
+    if (fseek(input, static_cast<long>(tableOffset), SEEK_SET) != 0 || fread(entries, 4, colors, input) != colors)
+        throw std::runtime_error("Cannot read color table");
+
+    PaletteExpander expander(entries, colors);
+    const unsigned int bits = bitCount;                              // Header is replaced by a 32-bit one below
+    bool topDown = height < 0;
+    height = std::abs(height);
+
+    size_t stride = ((static_cast<size_t>(width) * bits + 31) / 32) * 4;
+    std::vector<unsigned char> rows(stride * height);
+    if (fseek(input, offBits, SEEK_SET) != 0 || fread(rows.data(), 1, stride * height, input) != stride * height)
+        throw std::runtime_error("Cannot read indexed pixels");
+
+    format = PixelFormat::BGRA8;
+    initHeader();
+    image.reset(allocatePixels(static_cast<size_t>(width) * height * 4));
+    image.get_deleter().owned = true;
+
+    for (int row = 0; row < height; row++) {
+        const unsigned char *src = rows.data() + stride * row;
+        unsigned int *dst = reinterpret_cast<unsigned int *>(image.get()) +
+                            static_cast<size_t>(topDown ? height - 1 - row : row) * width;
+
+        if (bits == 8)
+            expander.Expand8(src, dst, width);
+        else
+            expander.Expand4(src, dst, width);
+    }
+}
@@ -0,0 +1,249 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "BitMapImage.h"
+
+/*
+ * QOI, "Quite OK Image" format: 14-byte header followed by a stream of chunks, each describing one pixel or a run of
+ * them relative to the previous pixel or to a 64-entry table of recently seen pixels. Rows are stored top to bottom in
+ * RGBA order, so rows are flipped and channels swapped on the way to BMP order. Pixels are kept as 32-bit words in
+ * memory order of BitMapImage (B, G, R, A from the lowest byte) during the whole process.
+ */
+
+using std::unique_ptr;
+
+const unsigned int QOI_HEADER_SIZE = 14;
+const unsigned char QOI_PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+const unsigned char QOI_OP_INDEX = 0x00;  // 00xxxxxx
+const unsigned char QOI_OP_DIFF = 0x40;   // 01xxxxxx
+const unsigned char QOI_OP_LUMA = 0x80;   // 10xxxxxx
+const unsigned char QOI_OP_RUN = 0xc0;    // 11xxxxxx
+const unsigned char QOI_OP_RGB = 0xfe;
+const unsigned char QOI_OP_RGBA = 0xff;
+const unsigned char QOI_MASK_2 = 0xc0;
+
+// (red * 3 + green * 5 + blue * 7 + alpha * 11) % 64 with a single multiplication, every product lands in the top byte
+static inline unsigned int qoiHash(unsigned int pixel) {
+    unsigned long long spread = (static_cast<unsigned long long>(pixel & 0xff00ff00) << 32) | (pixel & 0x00ff00ff);
+    return (spread * 0x070003000005000bull) >> 56 & 63;
+}
+
+// Adds bytes of two words independently, carries do not cross into the next channel
+static inline unsigned int addBytes(unsigned int a, unsigned int b) {
+    return ((a & 0x7f7f7f7f) + (b & 0x7f7f7f7f)) ^ ((a ^ b) & 0x80808080);
+}
+
+static inline unsigned int readBigEndian(const unsigned char *bytes) {
+    return static_cast<unsigned int>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+static inline void writeBigEndian(unsigned char *bytes, unsigned int value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+void BitMapImage::loadQoi(FILE *input) {
+    fseek(input, 0, SEEK_END);
+    long fileLength = ftell(input);
+    fseek(input, 0, SEEK_SET);
+
+    if (fileLength < static_cast<long>(QOI_HEADER_SIZE + sizeof(QOI_PADDING)))
+        throw std::runtime_error("QOI file is truncated");
+
+    // Chunks are at most 5 bytes long, so the padding lets decoder read them without checking the end every time
+    size_t length = fileLength;
+    unique_ptr<unsigned char[]> data(new unsigned char[length + 8]());
+
+    if (fread(data.get(), 1, length, input) != length)
+        throw std::runtime_error("Cannot read QOI file");
+
+    width = readBigEndian(data.get() + 4);
+    height = readBigEndian(data.get() + 8);
+    unsigned char channels = data[12];
+
+    if (width <= 0 || height <= 0 || (channels != 3 && channels != 4) ||
+        static_cast<size_t>(width) * height > (static_cast<size_t>(1) << 30))
+        throw std::runtime_error("Invalid QOI header");
+
+    format = PixelFormat::BGRA8;
+    initHeader();
+    image.reset(allocatePixels(static_cast<size_t>(width) * height * 4));
+    image.get_deleter().owned = true;
+
+    unsigned int index[64] = {};
+    unsigned int pixel = 0xff000000;     // Opaque black
+    size_t pos = QOI_HEADER_SIZE;
+    const size_t chunksEnd = length - sizeof(QOI_PADDING);
+
+    for (int row = height - 1; row >= 0; row--) {
+        unsigned int *dst = reinterpret_cast<unsigned int *>(image.get()) + static_cast<size_t>(row) * width;
+        int xcur = 0;
+
+        while (xcur < width) {
+            if (pos >= chunksEnd) {
+                std::fill(dst + xcur, dst + width, pixel);       // Truncated stream repeats the last pixel
+                break;
+            }
+
+            unsigned char tag = data[pos++];
+
+            if ((tag & QOI_MASK_2) == QOI_OP_INDEX) {
+                pixel = index[tag];
+                dst[xcur++] = pixel;
+                continue;
+            }
+
+            if ((tag & QOI_MASK_2) == QOI_OP_DIFF) {
+                // Deltas are biased by 2, subtracting 0x020202 byte-wise is adding 0xfefefe
+                unsigned int delta = (tag >> 4 & 3) << 16 | (tag >> 2 & 3) << 8 | (tag & 3);
+                pixel = addBytes(pixel, addBytes(delta, 0x00fefefe));
+            } else if ((tag & QOI_MASK_2) == QOI_OP_LUMA) {
+                unsigned int greenDiff = (tag & 0x3f) - 32;
+                unsigned int next = data[pos++];
+                unsigned int redDiff = greenDiff - 8 + (next >> 4);
+                unsigned int blueDiff = greenDiff - 8 + (next & 0x0f);
+                pixel = addBytes(pixel, (redDiff & 0xff) << 16 | (greenDiff & 0xff) << 8 | (blueDiff & 0xff));
+            } else if (tag == QOI_OP_RGB) {
+                pixel = (pixel & 0xff000000) | data[pos] << 16 | data[pos + 1] << 8 | data[pos + 2];
+                pos += 3;
+            } else if (tag == QOI_OP_RGBA) {
+                pixel = static_cast<unsigned int>(data[pos + 3]) << 24 | data[pos] << 16 | data[pos + 1] << 8 |
+                        data[pos + 2];
+                pos += 4;
+            } else {
+                // Run may continue on the next rows
+                unsigned int run = (tag & 0x3f) + 1;
+
+                while (run) {
+                    unsigned int count = std::min<unsigned int>(run, width - xcur);
+                    std::fill(dst + xcur, dst + xcur + count, pixel);
+                    xcur += count;
+                    run -= count;
+
+                    if (run && xcur == width) {
+                        if (--row < 0)
+                            return;
+
+                        dst -= width;
+                        xcur = 0;
+                    }
+                }
+
+                continue;
+            }
+
+            index[qoiHash(pixel)] = pixel;
+            dst[xcur++] = pixel;
+        }
+    }
+}
+
+void BitMapImage::SaveQoi(const char *filename) const {
+    if (format != PixelFormat::BGRA8) {
+        BitMapImage narrow(width, height, format);
+        narrow.deepCopy(*this);
+        narrow.ConvertTo(PixelFormat::BGRA8);
+        narrow.SaveQoi(filename);
+        return;
+    }
+
+    size_t pixels = static_cast<size_t>(width) * height;
+    const unsigned char *source = image.get();
+
+    // Worst case is QOI_OP_RGBA for every pixel
+    unique_ptr<unsigned char[]> out(new unsigned char[QOI_HEADER_SIZE + pixels * 5 + sizeof(QOI_PADDING)]);
+    unsigned char *dst = out.get();
+
+    memcpy(dst, "qoif", 4);
+    writeBigEndian(dst + 4, width);
+    writeBigEndian(dst + 8, height);
+    dst[12] = 4;                         // RGBA
+    dst[13] = 0;                         // sRGB with linear alpha
+    dst += QOI_HEADER_SIZE;
+
+    unsigned int index[64] = {};
+    unsigned int previous = 0xff000000;
+    unsigned int run = 0;
+
+    for (int row = height - 1; row >= 0; row--) {
+        const unsigned int *src = reinterpret_cast<const unsigned int *>(source) + static_cast<size_t>(row) * width;
+
+        for (int xcur = 0; xcur < width; xcur++) {
+            unsigned int pixel = src[xcur];
+
+            if (pixel == previous) {
+                if (++run == 62) {
+                    *dst++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+
+                continue;
+            }
+
+            if (run) {
+                *dst++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            unsigned int hash = qoiHash(pixel);
+
+            if (index[hash] == pixel) {
+                *dst++ = QOI_OP_INDEX | hash;
+            } else {
+                index[hash] = pixel;
+
+                if ((pixel ^ previous) >> 24) {
+                    *dst++ = QOI_OP_RGBA;
+                    *dst++ = pixel >> 16;
+                    *dst++ = pixel >> 8;
+                    *dst++ = pixel;
+                    *dst++ = pixel >> 24;
+                } else {
+                    signed char redDiff = static_cast<signed char>((pixel >> 16) - (previous >> 16));
+                    signed char greenDiff = static_cast<signed char>((pixel >> 8) - (previous >> 8));
+                    signed char blueDiff = static_cast<signed char>(pixel - previous);
+                    signed char redGreen = static_cast<signed char>(redDiff - greenDiff);
+                    signed char blueGreen = static_cast<signed char>(blueDiff - greenDiff);
+
+                    if (redDiff >= -2 && redDiff <= 1 && greenDiff >= -2 && greenDiff <= 1 && blueDiff >= -2 &&
+                        blueDiff <= 1) {
+                        *dst++ = QOI_OP_DIFF | (redDiff + 2) << 4 | (greenDiff + 2) << 2 | (blueDiff + 2);
+                    } else if (redGreen >= -8 && redGreen <= 7 && greenDiff >= -32 && greenDiff <= 31 &&
+                               blueGreen >= -8 && blueGreen <= 7) {
+                        *dst++ = QOI_OP_LUMA | (greenDiff + 32);
+                        *dst++ = (redGreen + 8) << 4 | (blueGreen + 8);
+                    } else {
+                        *dst++ = QOI_OP_RGB;
+                        *dst++ = pixel >> 16;
+                        *dst++ = pixel >> 8;
+                        *dst++ = pixel;
+                    }
+                }
+            }
+
+            previous = pixel;
+        }
+    }
+
+    if (run)
+        *dst++ = QOI_OP_RUN | (run - 1);
+
+    memcpy(dst, QOI_PADDING, sizeof(QOI_PADDING));
+    dst += sizeof(QOI_PADDING);
+
+    unique_ptr<FILE, decltype(&fclose)> output(fopen(filename, "wb"), &fclose);
+
+    if (!output)
+        throw std::runtime_error("Cannot create file");
+
+    const size_t size = dst - out.get();
+    bool written = fwrite(out.get(), 1, size, output.get()) == size;
+
+    // Full disk often shows only when buffered data is flushed on close
+    if (fclose(output.release()) != 0 || !written)
+        throw std::runtime_error("Cannot write file");
+}
@@ -0,0 +1,463 @@
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+
+/*
+ * Linear interpolation between two groups of eight pixels. Weights hold 8-bit fraction of b for each pixel,
+ * duplicated into both 16-bit halves of the 32-bit element: result = (a * (256 - w) + b * w + 128) >> 8
+ */
+static inline __m256i lerpPixels(__m256i a, __m256i b, __m256i weights) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(256);
+    const __m256i half = _mm256_set1_epi16(128);
+
+    __m256i weights1 = _mm256_unpacklo_epi32(weights, weights);       // Same order as _mm256_unpacklo_epi8 of pixels
+    __m256i weights2 = _mm256_unpackhi_epi32(weights, weights);
+
+    __m256i res1 = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zeroes), _mm256_sub_epi16(full, weights1)),
+                                    _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zeroes), weights1));
+    __m256i res2 = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zeroes), _mm256_sub_epi16(full, weights2)),
+                                    _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zeroes), weights2));
+
+    res1 = _mm256_srli_epi16(_mm256_add_epi16(res1, half), 8);
+    res2 = _mm256_srli_epi16(_mm256_add_epi16(res2, half), 8);
+
+    return _mm256_packus_epi16(res1, res2);
+}
+
+// Scalar version of lerpPixels for a single pixel
+static inline unsigned int lerpPixel(unsigned int a, unsigned int b, unsigned int weight) {
+    unsigned int result = 0;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        unsigned int channel = (((a >> shift) & 0xff) * (256 - weight) + ((b >> shift) & 0xff) * weight + 128) >> 8;
+        result |= channel << shift;
+    }
+
+    return result;
+}
+
+/*
+ * Filters work on colors premultiplied by alpha, otherwise colors of transparent texels, usually black, bleed into
+ * the edges of the sprite. Alpha byte holds the weight of every color byte, which is zero in the alpha lane.
+ */
+static const __m256i ALPHA_SPREAD = _mm256_setr_epi8(6, -128, 6, -128, 6, -128, -128, -128,
+                                                     14, -128, 14, -128, 14, -128, -128, -128,
+                                                     6, -128, 6, -128, 6, -128, -128, -128,
+                                                     14, -128, 14, -128, 14, -128, -128, -128);
+
+// Scales colors of eight pixels by their alpha / 255, rounded; alpha is kept
+static inline __m256i premultiplyPixels(__m256i pixels) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    const __m256i keepAlpha = _mm256_set1_epi64x(0x00ff000000000000ll);
+
+    __m256i low = _mm256_unpacklo_epi8(pixels, zeroes);
+    __m256i high = _mm256_unpackhi_epi8(pixels, zeroes);
+
+    low = div255(_mm256_mullo_epi16(low, _mm256_or_si256(_mm256_shuffle_epi8(low, ALPHA_SPREAD), keepAlpha)));
+    high = div255(_mm256_mullo_epi16(high, _mm256_or_si256(_mm256_shuffle_epi8(high, ALPHA_SPREAD), keepAlpha)));
+
+    return _mm256_packus_epi16(low, high);
+}
+
+static inline __m256i gatherPremultiplied(const int *pixels, __m256i indices) {
+    return premultiplyPixels(_mm256_i32gather_epi32(pixels, indices, 4));
+}
+
+static inline unsigned int premultiplyPixel(unsigned int pixel) {
+    unsigned int alpha = pixel >> 24;
+    unsigned int result = pixel & 0xff000000;
+
+    for (int shift = 0; shift < 24; shift += 8)
+        result |= static_cast<unsigned int>(div255(((pixel >> shift) & 0xff) * alpha)) << shift;
+
+    return result;
+}
+
+// Blends filtered samples with premultiplied colors: bkg * (256 - alpha) / 256 + frg, background alpha is kept
+static inline __m256i blendPremultiplied(__m256i bkg, __m256i frg) {
+    const __m256i zeroes = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(256);
+    const __m256i colors = _mm256_set1_epi32(0x00ffffff);
+
+    __m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(bkg, zeroes),
+                                     _mm256_sub_epi16(full, _mm256_shuffle_epi8(_mm256_unpacklo_epi8(frg, zeroes),
+                                                                                ALPHA_SPREAD)));
+    __m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(bkg, zeroes),
+                                      _mm256_sub_epi16(full, _mm256_shuffle_epi8(_mm256_unpackhi_epi8(frg, zeroes),
+                                                                                 ALPHA_SPREAD)));
+
+    __m256i kept = _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+    return _mm256_adds_epu8(kept, _mm256_and_si256(frg, colors));
+}
+
+static inline void blendPremultipliedPixel(unsigned char *bkg, unsigned int frg) {
+    unsigned int alpha = frg >> 24;
+
+    for (int channel = 0; channel < 3; channel++)
+        bkg[channel] = std::min((bkg[channel] * (256 - alpha) >> 8) + ((frg >> (channel * 8)) & 0xff), 255u);
+}
+
+/*
+ * Maps destination coordinate to the source one for bilinear filtering, aligning pixel centers. Returns two
+ * neighbouring source pixels and 8-bit weight of the second one, clamped at the edges.
+ */
+static inline void bilinearTap(int dst, int dstSize, int srcSize, int &first, int &second, unsigned int &weight) {
+    long long pos = ((static_cast<long long>(2 * dst + 1) * srcSize) << 16) / (2 * dstSize) - 32768;
+
+    if (pos < 0)
+        pos = 0;
+
+    first = static_cast<int>(pos >> 16);
+    weight = (pos >> 8) & 0xff;
+
+    if (first >= srcSize - 1) {
+        first = srcSize - 1;
+        weight = 0;
+    }
+
+    second = std::min(first + 1, srcSize - 1);
+}
+
+void BitMapImage::blendScaledBilinear(const BitMapImage &foreground, const Rect &dstRect, const Rect &clipped) {
+    const unsigned int *frg_ptr = reinterpret_cast<const unsigned int *>(foreground.image.get());
+    unsigned char *bkg_ptr = image.get();
+
+    // Horizontal taps are the same for every row, so they are computed only once
+    std::vector<int> firstColumns(clipped.width);
+    std::vector<int> secondColumns(clipped.width);
+    std::vector<unsigned int> columnWeights(clipped.width);
+
+    for (int xcur = 0; xcur < clipped.width; xcur++) {
+        unsigned int weight = 0;
+        bilinearTap(clipped.x - dstRect.x + xcur, dstRect.width, foreground.width, firstColumns[xcur],
+                    secondColumns[xcur], weight);
+        columnWeights[xcur] = weight * 0x00010001;
+    }
+
+    for (int ycur = 0; ycur < clipped.height; ycur++) {
+        int firstRow = 0;
+        int secondRow = 0;
+        unsigned int rowWeight = 0;
+        bilinearTap(clipped.y - dstRect.y + ycur, dstRect.height, foreground.height, firstRow, secondRow, rowWeight);
+
+        const unsigned int *top = frg_ptr + static_cast<size_t>(firstRow) * foreground.width;
+        const unsigned int *bottom = frg_ptr + static_cast<size_t>(secondRow) * foreground.width;
+        unsigned char *bkg = bkg_ptr + ((static_cast<size_t>(clipped.y + ycur) * width + clipped.x) << 2);
+
+        const __m256i verticalWeights = _mm256_set1_epi32(rowWeight * 0x00010001);
+
+        int xcur = 0;
+
+        for (; xcur + 8 <= clipped.width; xcur += 8) {
+            __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&firstColumns[xcur]));
+            __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&secondColumns[xcur]));
+            __m256i weights = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&columnWeights[xcur]));
+
+            const int *topRow = reinterpret_cast<const int *>(top);
+            const int *bottomRow = reinterpret_cast<const int *>(bottom);
+            __m256i topLeft = gatherPremultiplied(topRow, first);
+            __m256i topRight = gatherPremultiplied(topRow, second);
+            __m256i bottomLeft = gatherPremultiplied(bottomRow, first);
+            __m256i bottomRight = gatherPremultiplied(bottomRow, second);
+
+            __m256i sample = lerpPixels(lerpPixels(topLeft, topRight, weights),
+                                        lerpPixels(bottomLeft, bottomRight, weights), verticalWeights);
+
+            __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+            _mm256_storeu_si256(dst, blendPremultiplied(_mm256_loadu_si256(dst), sample));
+        }
+
+        for (; xcur < clipped.width; xcur++) {
+            unsigned int weight = columnWeights[xcur] & 0xffff;
+            unsigned int sample = lerpPixel(lerpPixel(premultiplyPixel(top[firstColumns[xcur]]),
+                                                      premultiplyPixel(top[secondColumns[xcur]]), weight),
+                                            lerpPixel(premultiplyPixel(bottom[firstColumns[xcur]]),
+                                                      premultiplyPixel(bottom[secondColumns[xcur]]), weight),
+                                            rowWeight);
+
+            blendPremultipliedPixel(bkg + (xcur << 2), sample);
+        }
+    }
+}
+
+// Range of source pixels covered by destination pixel, at least one pixel wide
+static inline void boxTap(int dst, int dstSize, int srcSize, int &begin, int &end) {
+    begin = static_cast<int>(static_cast<long long>(dst) * srcSize / dstSize);
+    end = static_cast<int>((static_cast<long long>(dst + 1) * srcSize + dstSize - 1) / dstSize);
+    end = std::max(end, begin + 1);
+}
+
+// Premultiplies two pixels with channels widened to 32 bits, one pixel in each half
+static inline __m256i premultiplyWide(__m256i pixels) {
+    const __m256i half = _mm256_set1_epi32(128);
+    __m256i alpha = _mm256_blend_epi32(_mm256_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _mm256_set1_epi32(255),
+                                       0x88);
+    __m256i product = _mm256_add_epi32(_mm256_mullo_epi32(pixels, alpha), half);
+    return _mm256_srli_epi32(_mm256_add_epi32(product, _mm256_srli_epi32(product, 8)), 8);
+}
+
+void BitMapImage::blendScaledBox(const BitMapImage &foreground, const Rect &dstRect, const Rect &clipped) {
+    const unsigned char *frg_ptr = foreground.image.get();
+    unsigned char *bkg_ptr = image.get();
+
+    std::vector<int> columnBegins(clipped.width);
+    std::vector<int> columnEnds(clipped.width);
+
+    for (int xcur = 0; xcur < clipped.width; xcur++)
+        boxTap(clipped.x - dstRect.x + xcur, dstRect.width, foreground.width, columnBegins[xcur], columnEnds[xcur]);
+
+    alignas(32) unsigned int samples[8];
+
+    for (int ycur = 0; ycur < clipped.height; ycur++) {
+        int rowBegin = 0;
+        int rowEnd = 0;
+        boxTap(clipped.y - dstRect.y + ycur, dstRect.height, foreground.height, rowBegin, rowEnd);
+
+        unsigned char *bkg = bkg_ptr + ((static_cast<size_t>(clipped.y + ycur) * width + clipped.x) << 2);
+
+        for (int xchunk = 0; xchunk < clipped.width; xchunk += 8) {
+            int chunk = std::min(8, clipped.width - xchunk);
+
+            for (int i = 0; i < chunk; i++) {
+                int begin = columnBegins[xchunk + i];
+                int end = columnEnds[xchunk + i];
+
+                // Two pixels are summed at once, channels of each are widened to 32 bits and premultiplied
+                __m256i sums = _mm256_setzero_si256();
+
+                for (int row = rowBegin; row < rowEnd; row++) {
+                    const unsigned char *src = frg_ptr + ((static_cast<size_t>(row) * foreground.width) << 2);
+                    int col = begin;
+
+                    for (; col + 2 <= end; col += 2)
+                        sums = _mm256_add_epi32(sums, premultiplyWide(_mm256_cvtepu8_epi32(
+                                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + (col << 2))))));
+
+                    if (col < end)
+                        sums = _mm256_add_epi32(sums, premultiplyWide(_mm256_cvtepu8_epi32(
+                                _mm_cvtsi32_si128(*reinterpret_cast<const int *>(src + (col << 2))))));
+                }
+
+                __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+                __m128 average = _mm_mul_ps(_mm_cvtepi32_ps(sum),
+                                            _mm_set1_ps(1.0f / static_cast<float>((end - begin) * (rowEnd - rowBegin))));
+
+                __m128i channels = _mm_cvtps_epi32(average);
+                channels = _mm_packus_epi16(_mm_packus_epi32(channels, channels), channels);
+                samples[i] = _mm_cvtsi128_si32(channels);
+            }
+
+            if (chunk == 8) {
+                __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xchunk << 2));
+                __m256i sample = _mm256_load_si256(reinterpret_cast<const __m256i *>(samples));
+                _mm256_storeu_si256(dst, blendPremultiplied(_mm256_loadu_si256(dst), sample));
+            } else {
+                for (int i = 0; i < chunk; i++)
+                    blendPremultipliedPixel(bkg + ((xchunk + i) << 2), samples[i]);
+            }
+        }
+    }
+}
+
+void BitMapImage::requireFormat8() const {
+    if (format != PixelFormat::BGRA8)
+        throw std::runtime_error("Only 8-bit pixels are supported");
+}
+
+void BitMapImage::BlendScaled(const BitMapImage &foreground, const Rect &dstRect, ScaleFilter filter) {
+    requireFormat8();
+    foreground.requireFormat8();
+
+    if (dstRect.width <= 0 || dstRect.height <= 0)
+        return;
+
+    MarkModified();
+
+    Rect clipped;
+    clipped.x = std::max(dstRect.x, 0);
+    clipped.y = std::max(dstRect.y, 0);
+    clipped.width = std::min(dstRect.x + dstRect.width, width) - clipped.x;
+    clipped.height = std::min(dstRect.y + dstRect.height, height) - clipped.y;
+
+    if (clipped.width <= 0 || clipped.height <= 0)
+        return;
+
+    if (filter == ScaleFilter::Box)
+        blendScaledBox(foreground, dstRect, clipped);
+    else
+        blendScaledBilinear(foreground, dstRect, clipped);
+}
+
+AffineTransform AffineTransform::Translation(double tx, double ty) {
+    return {1, 0, 0, 1, tx, ty};
+}
+
+AffineTransform AffineTransform::Rotation(double radians) {
+    double cosine = cos(radians);
+    double sine = sin(radians);
+
+    return {cosine, -sine, sine, cosine, 0, 0};
+}
+
+AffineTransform AffineTransform::Scaling(double sx, double sy) {
+    return {sx, 0, 0, sy, 0, 0};
+}
+
+AffineTransform AffineTransform::Shear(double kx, double ky) {
+    return {1, kx, ky, 1, 0, 0};
+}
+
+AffineTransform AffineTransform::operator*(const AffineTransform &other) const {
+    return {a * other.a + b * other.c, a * other.b + b * other.d,
+            c * other.a + d * other.c, c * other.b + d * other.d,
+            a * other.tx + b * other.ty + tx, c * other.tx + d * other.ty + ty};
+}
+
+AffineTransform AffineTransform::Inverted() const {
+    double det = a * d - b * c;
+
+    if (fabs(det) < 1e-12)
+        throw std::runtime_error("Transform is not invertible");
+
+    return {d / det, -b / det, -c / det, a / det, (b * ty - d * tx) / det, (c * tx - a * ty) / det};
+}
+
+// Narrows [begin, end] to the values of x for which start + step * x stays within [low, high]
+static inline void clipSpan(double start, double step, double low, double high, double &begin, double &end) {
+    if (fabs(step) < 1e-12) {
+        if (start < low || start > high)
+            end = begin - 1;
+        return;
+    }
+
+    double first = (low - start) / step;
+    double last = (high - start) / step;
+
+    if (step < 0)
+        std::swap(first, last);
+
+    begin = std::max(begin, first);
+    end = std::min(end, last);
+}
+
+void BitMapImage::BlendTransformed(const BitMapImage &foreground, const AffineTransform &transform) {
+    requireFormat8();
+    foreground.requireFormat8();
+
+    MarkModified();
+
+    const AffineTransform inverse = transform.Inverted();
+    const int *frg_ptr = reinterpret_cast<const int *>(foreground.image.get());
+    unsigned char *bkg_ptr = image.get();
+
+    // Destination bounding box of transformed foreground corners, clipped to the background
+    double xMin = width;
+    double xMax = 0;
+    double yMin = height;
+    double yMax = 0;
+
+    for (int corner = 0; corner < 4; corner++) {
+        double u = (corner & 1) ? foreground.width : 0;
+        double v = (corner & 2) ? foreground.height : 0;
+        double x = transform.a * u + transform.b * v + transform.tx;
+        double y = transform.c * u + transform.d * v + transform.ty;
+
+        xMin = std::min(xMin, x);
+        xMax = std::max(xMax, x);
+        yMin = std::min(yMin, y);
+        yMax = std::max(yMax, y);
+    }
+
+    int rowBegin = std::max(0, static_cast<int>(floor(yMin)));
+    int rowEnd = std::min(height, static_cast<int>(ceil(yMax)) + 1);
+    int columnBegin = std::max(0, static_cast<int>(floor(xMin)));
+    int columnEnd = std::min(width, static_cast<int>(ceil(xMax)) + 1);
+
+    const double uMax = foreground.width - 0.5;
+    const double vMax = foreground.height - 0.5;
+
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lastColumn = _mm256_set1_ps(static_cast<float>(foreground.width - 1));
+    const __m256 lastRow = _mm256_set1_ps(static_cast<float>(foreground.height - 1));
+    const __m256 fractionScale = _mm256_set1_ps(256.0f);
+    const __m256i lastColumnIndex = _mm256_set1_epi32(foreground.width - 1);
+    const __m256i lastRowIndex = _mm256_set1_epi32(foreground.height - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i stride = _mm256_set1_epi32(foreground.width);
+    const __m256i duplicate = _mm256_set1_epi32(0x00010001);
+
+    const __m256 uStep = _mm256_set1_ps(static_cast<float>(inverse.a * 8));
+    const __m256 vStep = _mm256_set1_ps(static_cast<float>(inverse.c * 8));
+
+    alignas(32) unsigned int samples[8];
+
+    for (int ycur = rowBegin; ycur < rowEnd; ycur++) {
+        // Source coordinates of pixel centers along the row are uStart + inverse.a * x and vStart + inverse.c * x
+        double uStart = inverse.b * (ycur + 0.5) + inverse.tx + inverse.a * 0.5 - 0.5;
+        double vStart = inverse.d * (ycur + 0.5) + inverse.ty + inverse.c * 0.5 - 0.5;
+
+        double spanBegin = columnBegin;
+        double spanEnd = columnEnd - 1;
+        clipSpan(uStart, inverse.a, -0.5, uMax, spanBegin, spanEnd);
+        clipSpan(vStart, inverse.c, -0.5, vMax, spanBegin, spanEnd);
+
+        if (spanEnd < spanBegin)
+            continue;
+
+        int xBegin = static_cast<int>(ceil(spanBegin));
+        int xEnd = static_cast<int>(floor(spanEnd)) + 1;
+
+        __m256 u = _mm256_fmadd_ps(lanes, _mm256_set1_ps(static_cast<float>(inverse.a)),
+                                   _mm256_set1_ps(static_cast<float>(uStart + inverse.a * xBegin)));
+        __m256 v = _mm256_fmadd_ps(lanes, _mm256_set1_ps(static_cast<float>(inverse.c)),
+                                   _mm256_set1_ps(static_cast<float>(vStart + inverse.c * xBegin)));
+
+        unsigned char *bkg = bkg_ptr + ((static_cast<size_t>(ycur) * width) << 2);
+
+        for (int xcur = xBegin; xcur < xEnd; xcur += 8) {
+            __m256 uClamped = _mm256_min_ps(_mm256_max_ps(u, zero), lastColumn);
+            __m256 vClamped = _mm256_min_ps(_mm256_max_ps(v, zero), lastRow);
+
+            __m256i column = _mm256_cvttps_epi32(uClamped);
+            __m256i row = _mm256_cvttps_epi32(vClamped);
+
+            __m256i uWeights = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(uClamped, _mm256_cvtepi32_ps(column)),
+                                                                 fractionScale));
+            __m256i vWeights = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(vClamped, _mm256_cvtepi32_ps(row)),
+                                                                 fractionScale));
+            uWeights = _mm256_mullo_epi32(uWeights, duplicate);
+            vWeights = _mm256_mullo_epi32(vWeights, duplicate);
+
+            __m256i nextColumn = _mm256_min_epi32(_mm256_add_epi32(column, one), lastColumnIndex);
+            __m256i top = _mm256_mullo_epi32(row, stride);
+            __m256i bottom = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_add_epi32(row, one), lastRowIndex), stride);
+
+            __m256i topLeft = gatherPremultiplied(frg_ptr, _mm256_add_epi32(top, column));
+            __m256i topRight = gatherPremultiplied(frg_ptr, _mm256_add_epi32(top, nextColumn));
+            __m256i bottomLeft = gatherPremultiplied(frg_ptr, _mm256_add_epi32(bottom, column));
+            __m256i bottomRight = gatherPremultiplied(frg_ptr, _mm256_add_epi32(bottom, nextColumn));
+
+            __m256i sample = lerpPixels(lerpPixels(topLeft, topRight, uWeights),
+                                        lerpPixels(bottomLeft, bottomRight, uWeights), vWeights);
+
+            if (xcur + 8 <= xEnd) {
+                __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+                _mm256_storeu_si256(dst, blendPremultiplied(_mm256_loadu_si256(dst), sample));
+            } else {
+                _mm256_store_si256(reinterpret_cast<__m256i *>(samples), sample);
+
+                for (int i = 0; i < xEnd - xcur; i++)
+                    blendPremultipliedPixel(bkg + ((xcur + i) << 2), samples[i]);
+            }
+
+            u = _mm256_add_ps(u, uStep);
+            v = _mm256_add_ps(v, vStep);
+        }
+    }
+}
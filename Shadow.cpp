@@ -0,0 +1,220 @@
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "BlendKernels.h"
+#include "Shadow.h"
+
+/*
+ * Drop shadow is the alpha channel of the foreground blurred by two box filters of half the radius in each direction,
+ * which approximates Gaussian blur. Blur runs on float planes eight columns at a time, rows are blurred as columns of
+ * the transposed plane.
+ */
+static inline int roundUp8(int value) {
+    return (value + 7) & ~7;
+}
+
+// Box filter of given radius along columns, values outside of the plane are zero; stride is a multiple of 8
+static void blurColumns(float *plane, int rows, int stride, int radius, std::vector<float> &scratch) {
+    const __m256 scale = _mm256_set1_ps(1.0f / (2 * radius + 1));
+    scratch.assign(plane, plane + static_cast<size_t>(rows) * stride);
+
+    for (int column = 0; column < stride; column += 8) {
+        __m256 sum = _mm256_setzero_ps();
+
+        for (int row = 0; row < std::min(radius, rows); row++)
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(scratch.data() + static_cast<size_t>(row) * stride + column));
+
+        for (int row = 0; row < rows; row++) {
+            if (row + radius < rows)
+                sum = _mm256_add_ps(sum, _mm256_loadu_ps(scratch.data() + static_cast<size_t>(row + radius) * stride +
+                                                         column));
+
+            _mm256_storeu_ps(plane + static_cast<size_t>(row) * stride + column, _mm256_mul_ps(sum, scale));
+
+            if (row - radius >= 0)
+                sum = _mm256_sub_ps(sum, _mm256_loadu_ps(scratch.data() + static_cast<size_t>(row - radius) * stride +
+                                                         column));
+        }
+    }
+}
+
+static void transpose(const float *src, int rows, int columns, int srcStride, float *dst, int dstStride) {
+    for (int row = 0; row < rows; row++)
+        for (int column = 0; column < columns; column++)
+            dst[static_cast<size_t>(column) * dstStride + row] = src[static_cast<size_t>(row) * srcStride + column];
+}
+
+static std::shared_ptr<ShadowMask> computeShadow(const BitMapImage &foreground, unsigned int radius) {
+    const int boxRadius = (radius + 1) / 2;
+    auto shadow = std::make_shared<ShadowMask>();
+    shadow->padding = 2 * boxRadius;
+    shadow->width = foreground.Width() + 2 * shadow->padding;
+    shadow->height = foreground.Height() + 2 * shadow->padding;
+
+    const int stride = roundUp8(shadow->width);
+    const int transposedStride = roundUp8(shadow->height);
+    std::vector<float> plane(static_cast<size_t>(shadow->height) * stride);
+    std::vector<float> transposed(static_cast<size_t>(shadow->width) * transposedStride);
+    std::vector<float> scratch;
+
+    for (int row = 0; row < foreground.Height(); row++) {
+        const unsigned char *src = foreground.Pixels() + static_cast<size_t>(row) * foreground.Width() * 4;
+        float *dst = plane.data() + static_cast<size_t>(row + shadow->padding) * stride + shadow->padding;
+
+        for (int column = 0; column < foreground.Width(); column++)
+            dst[column] = src[column * 4 + 3];
+    }
+
+    transpose(plane.data(), shadow->height, shadow->width, stride, transposed.data(), transposedStride);
+
+    for (int pass = 0; pass < 2; pass++)
+        blurColumns(transposed.data(), shadow->width, transposedStride, boxRadius, scratch);
+
+    transpose(transposed.data(), shadow->width, shadow->height, transposedStride, plane.data(), stride);
+
+    for (int pass = 0; pass < 2; pass++)
+        blurColumns(plane.data(), shadow->height, stride, boxRadius, scratch);
+
+    shadow->alpha.resize(static_cast<size_t>(shadow->width) * shadow->height);
+
+    for (int row = 0; row < shadow->height; row++)
+        for (int column = 0; column < shadow->width; column++)
+            shadow->alpha[static_cast<size_t>(row) * shadow->width + column] = static_cast<unsigned char>(
+                    std::min(plane[static_cast<size_t>(row) * stride + column] + 0.5f, 255.0f));
+
+    return shadow;
+}
+
+std::shared_ptr<const ShadowMask> ShadowCache::Get(const BitMapImage &foreground, unsigned int radius) {
+    Key key(foreground.Identity(), foreground.Version(), radius);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = masks.find(key);
+
+        if (found != masks.end())
+            return found->second;
+    }
+
+    // Blurred without holding the lock, two threads may compute the same mask and the later one is kept
+    std::shared_ptr<const ShadowMask> shadow = computeShadow(foreground, radius);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (masks.size() >= capacity)
+        masks.clear();
+
+    masks[key] = shadow;
+    return shadow;
+}
+
+void ShadowCache::Invalidate(const BitMapImage &foreground) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto entry = masks.begin(); entry != masks.end();) {
+        if (std::get<0>(entry->first) == foreground.Identity())
+            entry = masks.erase(entry);
+        else
+            ++entry;
+    }
+}
+
+void ShadowCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    masks.clear();
+}
+
+// Shadow weights are in the lowest byte of every 32-bit element, sprite pixels are blended over the shadow
+static void blendShadowRow(unsigned char *bkg, const unsigned char *sprite, const unsigned char *shadow,
+                           unsigned int count, const Color &color) {
+    const __m256i colorVector = _mm256_set1_epi32(color.blue | color.green << 8 | color.red << 16);
+    const __m256i opacity = _mm256_set1_epi32(color.alpha + 1);
+    const __m256i alphaBytes = _mm256_set1_epi32(0xff000000);
+    const int channels[3] = {color.blue, color.green, color.red};
+    unsigned int xcur = 0;
+
+    for (; xcur + 8 <= count; xcur += 8) {
+        __m256i weights = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(shadow + xcur)));
+        weights = _mm256_srli_epi32(_mm256_mullo_epi16(weights, opacity), 8);
+
+        __m256i frg = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(sprite + (xcur << 2)));
+        bool shaded = !_mm256_testz_si256(weights, weights);
+        bool covered = !_mm256_testz_si256(frg, alphaBytes);
+
+        if (!shaded && !covered)
+            continue;                                                // Both layers transparent here
+
+        __m256i *dst = reinterpret_cast<__m256i *>(bkg + (xcur << 2));
+        __m256i pixels = _mm256_lddqu_si256(dst);
+
+        if (shaded)
+            pixels = blendPixelsWithAlpha(pixels, colorVector, spreadAlpha(weights));
+
+        if (covered)
+            pixels = blendPixels(pixels, frg);
+
+        _mm256_storeu_si256(dst, pixels);
+    }
+
+    for (; xcur < count; xcur++) {
+        int alpha = (shadow[xcur] * (color.alpha + 1)) >> 8;
+        unsigned char *pixel = bkg + (xcur << 2);
+
+        for (int channel = 0; channel < 3; channel++)
+            pixel[channel] += ((channels[channel] - pixel[channel]) * alpha) >> 8;
+
+        blendPixel(pixel, sprite + (xcur << 2));
+    }
+}
+
+void BitMapImage::BlendWithShadow(const BitMapImage &foreground, unsigned int x, unsigned int y, int offsetX,
+                                  int offsetY, unsigned int radius, Color color, ShadowCache *cache) {
+    requireFormat8();
+    foreground.requireFormat8();
+
+    if (x + foreground.width > static_cast<unsigned int>(width) ||
+        y + foreground.height > static_cast<unsigned int>(height))
+        throw std::runtime_error("Foreground does not fit into background");
+
+    MarkModified();
+
+    std::shared_ptr<const ShadowMask> shadow = cache ? cache->Get(foreground, radius)
+                                                     : computeShadow(foreground, radius);
+    const int shadowX = static_cast<int>(x) + offsetX - shadow->padding;
+    const int shadowY = static_cast<int>(y) + offsetY - shadow->padding;
+
+    // Shadow may stick out of the background, sprite may not
+    const int left = std::max(0, std::min<int>(x, shadowX));
+    const int right = std::min(width, std::max<int>(x + foreground.width, shadowX + shadow->width));
+    const int bottom = std::max(0, std::min<int>(y, shadowY));
+    const int top = std::min(height, std::max<int>(y + foreground.height, shadowY + shadow->height));
+    const int unionWidth = right - left;
+
+    // Rows of both layers are laid out over the whole union, so that every destination pixel is visited once
+    std::vector<unsigned char> shadowRow(unionWidth);
+    std::vector<unsigned char> spriteRow(static_cast<size_t>(unionWidth) * 4);
+    const int shadowBegin = std::max(shadowX, left);
+    const int shadowEnd = std::min(shadowX + shadow->width, right);
+
+    for (int ycur = bottom; ycur < top; ycur++) {
+        std::fill(shadowRow.begin(), shadowRow.end(), 0);
+
+        if (ycur >= shadowY && ycur < shadowY + shadow->height && shadowBegin < shadowEnd)
+            memcpy(shadowRow.data() + (shadowBegin - left),
+                   shadow->alpha.data() + static_cast<size_t>(ycur - shadowY) * shadow->width + (shadowBegin - shadowX),
+                   shadowEnd - shadowBegin);
+
+        std::fill(spriteRow.begin(), spriteRow.end(), 0);
+
+        if (ycur >= static_cast<int>(y) && ycur < static_cast<int>(y) + foreground.height)
+            memcpy(spriteRow.data() + (x - left) * 4,
+                   foreground.image.get() + static_cast<size_t>(ycur - y) * foreground.width * 4,
+                   static_cast<size_t>(foreground.width) * 4);
+
+        blendShadowRow(image.get() + ((static_cast<size_t>(ycur) * width) + left) * 4, spriteRow.data(),
+                       shadowRow.data(), unionWidth, color);
+    }
+}
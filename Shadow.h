@@ -0,0 +1,45 @@
+#ifndef ALPHABLENDING_SHADOW_H
+#define ALPHABLENDING_SHADOW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "BitMapImage.h"
+
+// Blurred alpha of a foreground, weights of the shadow color
+struct ShadowMask {
+    int width;
+    int height;
+    int padding;                         // Shadow extends by this many pixels on every side of the foreground
+    std::vector<unsigned char> alpha;
+};
+
+/*
+ * Blurred masks of foregrounds drawn with a shadow again and again. Masks are found by identity and version of the
+ * foreground and radius, so a picture blended into or destroyed never gets a stale mask. Pixels changed by hand are
+ * only noticed after MarkModified. Safe to share between threads. Once there are capacity masks the cache is simply
+ * emptied.
+ */
+class ShadowCache {
+private:
+    using Key = std::tuple<uint64_t, uint64_t, unsigned int>;     // Identity, version and radius
+
+    std::mutex mutex;
+    std::map<Key, std::shared_ptr<const ShadowMask>> masks;
+    size_t capacity;
+
+public:
+    explicit ShadowCache(size_t capacity = 32) : capacity(capacity) {}
+    ShadowCache(const ShadowCache &other) = delete;
+    ShadowCache &operator=(const ShadowCache &other) = delete;
+
+    std::shared_ptr<const ShadowMask> Get(const BitMapImage &foreground, unsigned int radius);
+    void Invalidate(const BitMapImage &foreground);                  // Drops masks of every radius and version
+    void Clear();
+};
+
+#endif //ALPHABLENDING_SHADOW_H
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "SpriteAtlas.h"
+
+SpriteAtlas::SpriteAtlas(const char *imagePath, const char *manifestPath, PixelFormat format) {
+    std::unique_ptr<FILE, int (*)(FILE *)> manifest(fopen(manifestPath, "r"), &fclose);
+
+    if (!manifest)
+        throw std::runtime_error("Cannot open file");
+
+    BitMapImage sheet(imagePath, format);
+    std::vector<Rect> regions;
+    char line[512];
+    int lineNumber = 0;
+
+    while (fgets(line, sizeof(line), manifest.get())) {
+        lineNumber++;
+        char name[256];
+        Rect region = {};
+        char first = 0;
+
+        if (sscanf(line, " %c", &first) != 1 || first == '#')
+            continue;                                                // Empty line or comment
+
+        if (sscanf(line, "%255s %d %d %d %d", name, &region.x, &region.y, &region.width, &region.height) != 5)
+            throw std::runtime_error("Invalid line " + std::to_string(lineNumber) + " of sprite manifest");
+
+        if (region.x < 0 || region.y < 0 || region.width <= 0 || region.height <= 0 ||
+            region.x + region.width > sheet.Width() || region.y + region.height > sheet.Height())
+            throw std::runtime_error("Sprite " + std::string(name) + " does not fit into atlas");
+
+        if (!lookup.emplace(name, regions.size()).second)
+            throw std::runtime_error("Sprite " + std::string(name) + " is listed twice");
+
+        names.emplace_back(name);
+        regions.push_back(region);
+    }
+
+    const size_t pixelSize = BitMapImage::BytesPerPixel(format);
+    std::vector<size_t> offsets;
+    size_t total = 0;
+
+    for (const Rect &region : regions) {
+        offsets.push_back(total);
+        total += (static_cast<size_t>(region.width) * region.height * pixelSize + 31) & ~static_cast<size_t>(31);
+    }
+
+    pixels.reset(allocatePixels(total));
+
+    for (size_t i = 0; i < regions.size(); i++) {
+        const Rect &region = regions[i];
+        size_t rowSize = region.width * pixelSize;
+        unsigned char *dst = pixels.get() + offsets[i];
+
+        for (int row = 0; row < region.height; row++)
+            memcpy(dst + row * rowSize,
+                   sheet.Pixels() + (static_cast<size_t>(region.y + row) * sheet.Width() + region.x) * pixelSize,
+                   rowSize);
+
+        sprites.emplace_back(new BitMapImage(region.width, region.height, dst, format));
+    }
+}
+
+size_t SpriteAtlas::Find(const std::string &name) const {
+    auto found = lookup.find(name);
+
+    if (found == lookup.end())
+        throw std::runtime_error("No sprite " + name + " in atlas");
+
+    return found->second;
+}
@@ -0,0 +1,38 @@
+#ifndef ALPHABLENDING_SPRITEATLAS_H
+#define ALPHABLENDING_SPRITEATLAS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "BitMapImage.h"
+
+/*
+ * Many small sprites loaded from one picture, so they cost one file, one header and one allocation instead of one
+ * each. Manifest is a text file with one sprite per line: "name x y width height", where coordinates are in pixel rows
+ * as stored in memory, just like everywhere else in the library. Empty lines and lines starting with # are skipped.
+ * On load every sprite is cut out of the sheet into one shared buffer, one after another at 32-byte aligned offsets,
+ * so rows of a sprite are contiguous and blending it reads consecutive cache lines, not rows a whole sheet apart.
+ * Sprites are images borrowing pixels of the atlas, they go to Blend like any other image.
+ */
+class SpriteAtlas {
+private:
+    std::unique_ptr<unsigned char[], free_deleter> pixels;
+    std::vector<std::unique_ptr<BitMapImage>> sprites;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, size_t> lookup;
+
+public:
+    SpriteAtlas(const char *imagePath, const char *manifestPath, PixelFormat format = PixelFormat::BGRA8);
+    SpriteAtlas(const SpriteAtlas &other) = delete;
+    SpriteAtlas &operator=(const SpriteAtlas &other) = delete;
+
+    size_t Find(const std::string &name) const;                     // Index of sprite, throws for unknown names
+    const BitMapImage &Sprite(size_t index) const { return *sprites[index]; }
+    const BitMapImage &Sprite(const std::string &name) const { return *sprites[Find(name)]; }
+    const std::string &Name(size_t index) const { return names[index]; }
+    size_t Count() const { return sprites.size(); }
+};
+
+#endif //ALPHABLENDING_SPRITEATLAS_H
@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <sched.h>
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    for (unsigned int i = 0; i < std::max(threads, 1u); i++) {
+        workers.emplace_back([this]() {
+            while (true) {
+                std::function<void()> task;
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+
+                    if (tasks.empty())
+                        return;
+
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+
+                task();
+            }
+        });
+    }
+}
+
+ThreadPool::ThreadPool(unsigned int threads, const std::vector<int> &cpus) : ThreadPool(threads) {
+    if (cpus.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+
+    // Nothing is queued yet, so every task already runs on given CPUs. Pinning is only a hint, failures are ignored
+    for (std::thread &worker : workers)
+        pthread_setaffinity_np(worker.native_handle(), sizeof(set), &set);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    ready.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+
+    ready.notify_one();
+}
+
+// Never destroyed, tasks may still be submitted while static objects are torn down at exit
+ThreadPool &ThreadPool::Shared() {
+    static ThreadPool *shared = new ThreadPool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+    return *shared;
+}
@@ -0,0 +1,32 @@
+#ifndef ALPHABLENDING_THREADPOOL_H
+#define ALPHABLENDING_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+
+public:
+    explicit ThreadPool(unsigned int threads);
+    ThreadPool(unsigned int threads, const std::vector<int> &cpus);  // Workers may only run on given CPUs
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool &operator=(const ThreadPool &other) = delete;
+    ~ThreadPool();                                                   // Finishes queued tasks and joins workers
+
+    void Submit(std::function<void()> task);
+
+    // Process-wide pool with a worker per CPU but one, for library code sharing work with the calling thread
+    static ThreadPool &Shared();
+};
+
+#endif //ALPHABLENDING_THREADPOOL_H
@@ -0,0 +1,187 @@
+#include <cstring>
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include "BlendKernels.h"
+#include "Watermark.h"
+
+Watermark::Watermark(const BitMapImage &foreground, const BlendOptions &options) : width(foreground.Width()),
+                                                                                   height(foreground.Height()),
+                                                                                   options(options) {
+    if (foreground.Format() != PixelFormat::BGRA8)
+        throw std::runtime_error("Watermark needs 8-bit foreground");
+
+    // Linear light falls back to Blend, which needs the pixels as they are and none of the prepared groups
+    if (options.linearLight) {
+        groupsPerRow = 0;
+        original.reset(new BitMapImage(width, height, nullptr, foreground.Format()));
+        original->deepCopy(foreground);                              // The only allocation of pixels
+        return;
+    }
+
+    groupsPerRow = (width + 7) / 8;
+    groups.resize(static_cast<size_t>(groupsPerRow) * height);
+    spans.resize(height);
+
+    const unsigned char *pixels = foreground.Pixels();
+    const int modulation[4] = {options.tintBlue, options.tintGreen, options.tintRed, options.opacity};
+    const int fullWeight = options.exact ? 255 : 256;
+
+    for (int ycur = 0; ycur < height; ycur++) {
+        for (unsigned int group = 0; group < groupsPerRow; group++) {
+            unsigned short premultiplied[2][16] = {};
+            unsigned short inverseAlpha[2][16] = {};
+            bool visible = false;
+
+            for (unsigned int pixel = 0; pixel < 8; pixel++) {
+                unsigned int xcur = group * 8 + pixel;
+                unsigned int half = (pixel >> 1) & 1;                // Pixels 0, 1, 4, 5 go to low half
+                unsigned int slot = ((pixel >> 2) << 1 | (pixel & 1)) * 4;
+                int alpha = 0;
+                int color[3] = {};
+
+                if (xcur < static_cast<unsigned int>(width)) {
+                    const unsigned char *frg = pixels + (static_cast<size_t>(ycur) * width + xcur) * 4;
+
+                    for (int channel = 0; channel < 4; channel++) {
+                        int value = options.exact ? div255(frg[channel] * modulation[channel])
+                                                  : (frg[channel] * (modulation[channel] + 1)) >> 8;
+                        (channel == 3 ? alpha : color[channel]) = value;
+                    }
+                }
+
+                for (int channel = 0; channel < 3; channel++) {
+                    premultiplied[half][slot + channel] = color[channel] * alpha;
+                    inverseAlpha[half][slot + channel] = fullWeight - alpha;
+                }
+
+                inverseAlpha[half][slot + 3] = fullWeight;
+                visible |= alpha != 0;
+            }
+
+            Group &target = groups[static_cast<size_t>(ycur) * groupsPerRow + group];
+            target.premultipliedLow = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(premultiplied[0]));
+            target.premultipliedHigh = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(premultiplied[1]));
+            target.inverseAlphaLow = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(inverseAlpha[0]));
+            target.inverseAlphaHigh = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(inverseAlpha[1]));
+
+            if (!visible)
+                continue;
+
+            auto &rowSpans = spans[ycur];
+
+            if (!rowSpans.empty() && rowSpans.back().second == group)
+                rowSpans.back().second++;
+            else
+                rowSpans.emplace_back(group, group + 1);
+        }
+    }
+}
+
+template<bool Exact>
+static inline __m256i applyGroup(__m256i bkg, const __m256i *group) {
+    const __m256i zeroes = _mm256_setzero_si256();
+
+    __m256i low = _mm256_unpacklo_epi8(bkg, zeroes);
+    __m256i high = _mm256_unpackhi_epi8(bkg, zeroes);
+
+    low = _mm256_add_epi16(_mm256_mullo_epi16(low, group[2]), group[0]);
+    high = _mm256_add_epi16(_mm256_mullo_epi16(high, group[3]), group[1]);
+
+    if (Exact) {
+        low = div255(low);
+        high = div255(high);
+    } else {
+        low = _mm256_srli_epi16(low, 8);
+        high = _mm256_srli_epi16(high, 8);
+    }
+
+    return _mm256_packus_epi16(low, high);
+}
+
+template<bool Exact>
+void Watermark::apply(BitMapImage &background, unsigned int x, unsigned int y) const {
+    const unsigned int fullGroups = width / 8;
+    const unsigned int tail = width % 8;
+
+    for (int ycur = 0; ycur < height; ycur++) {
+        unsigned char *bkg = background.Pixels() + ((static_cast<size_t>(y + ycur) * background.Width()) + x) * 4;
+        const Group *row = groups.data() + static_cast<size_t>(ycur) * groupsPerRow;
+
+        for (const auto &span : spans[ycur]) {
+            unsigned int end = std::min(span.second, fullGroups);
+
+            for (unsigned int group = span.first; group < end; group++) {
+                __m256i *dst = reinterpret_cast<__m256i *>(bkg + group * 32);
+                const __m256i *prepared = reinterpret_cast<const __m256i *>(row + group);
+                _mm256_storeu_si256(dst, applyGroup<Exact>(_mm256_loadu_si256(dst), prepared));
+            }
+
+            // Partial group at the end of the row goes through a copy, so nothing past the foreground is touched
+            if (tail && span.second > fullGroups) {
+                alignas(32) unsigned char partial[32] = {};
+                memcpy(partial, bkg + fullGroups * 32, tail * 4);
+
+                const __m256i *prepared = reinterpret_cast<const __m256i *>(row + fullGroups);
+                __m256i result = applyGroup<Exact>(_mm256_load_si256(reinterpret_cast<const __m256i *>(partial)),
+                                                   prepared);
+                _mm256_store_si256(reinterpret_cast<__m256i *>(partial), result);
+                memcpy(bkg + fullGroups * 32, partial, tail * 4);
+            }
+        }
+    }
+}
+
+void Watermark::Apply(BitMapImage &background, unsigned int x, unsigned int y) const {
+    if (background.Format() != PixelFormat::BGRA8)
+        throw std::runtime_error("Watermark needs 8-bit background");
+
+    if (x + width > static_cast<unsigned int>(background.Width()) ||
+        y + height > static_cast<unsigned int>(background.Height()))
+        throw std::runtime_error("Watermark does not fit into background");
+
+    background.MarkModified();
+
+    if (options.linearLight)
+        background.Blend(*original, x, y, options);
+    else if (options.exact)
+        apply<true>(background, x, y);
+    else
+        apply<false>(background, x, y);
+}
+
+void Watermark::ApplyMany(BitMapImage *const *backgrounds, size_t count, unsigned int x, unsigned int y,
+                          ThreadPool &pool) const {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = count;
+    std::exception_ptr failure;
+
+    for (size_t i = 0; i < count; i++) {
+        pool.Submit([&, i]() {
+            std::exception_ptr error;
+
+            try {
+                Apply(*backgrounds[i], x, y);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (error && !failure)
+                failure = error;
+
+            if (--remaining == 0)
+                done.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return remaining == 0; });
+
+    if (failure)
+        std::rethrow_exception(failure);
+}
@@ -0,0 +1,53 @@
+#ifndef ALPHABLENDING_WATERMARK_H
+#define ALPHABLENDING_WATERMARK_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <immintrin.h>
+#include "BitMapImage.h"
+#include "ThreadPool.h"
+
+/*
+ * Foreground prepared for being blended onto many backgrounds. Opacity and tint are applied once, pixels are widened
+ * to 16 bits and premultiplied by alpha, so that blending eight pixels is one multiply-add per half: (bkg * (256 - alpha)
+ * + frg * alpha) >> 8, which gives exactly the same result as Blend. Runs of eight fully transparent pixels are
+ * skipped. Only 8-bit images are supported, linear light blending falls back to Blend.
+ */
+class Watermark {
+private:
+    struct Group {                       // Eight pixels in the order of _mm256_unpacklo_epi8 / _mm256_unpackhi_epi8
+        __m256i premultipliedLow;
+        __m256i premultipliedHigh;
+        __m256i inverseAlphaLow;         // Alpha lane holds full weight, so background alpha is kept
+        __m256i inverseAlphaHigh;
+    };
+
+    int width;
+    int height;
+    unsigned int groupsPerRow;
+    BlendOptions options;
+    std::vector<Group> groups;
+    std::vector<std::vector<std::pair<unsigned int, unsigned int>>> spans;  // Visible groups of every row
+    std::unique_ptr<BitMapImage> original;                           // Only with linear light, it falls back to Blend
+
+    template<bool Exact>
+    void apply(BitMapImage &background, unsigned int x, unsigned int y) const;
+
+public:
+    explicit Watermark(const BitMapImage &foreground, const BlendOptions &options = BlendOptions());
+    Watermark(const Watermark &other) = delete;
+    Watermark &operator=(const Watermark &other) = delete;
+
+    void Apply(BitMapImage &background, unsigned int x, unsigned int y) const;
+
+    // Blends onto every background using threads of the pool, returns once all of them are done
+    void ApplyMany(BitMapImage *const *backgrounds, size_t count, unsigned int x, unsigned int y,
+                   ThreadPool &pool) const;
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+};
+
+#endif //ALPHABLENDING_WATERMARK_H
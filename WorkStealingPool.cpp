@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include "WorkStealingPool.h"
+#include "LatencyMetrics.h"
+
+// Rows blended at once by a worker between looking whether thieves have taken everything from its deque
+static const int bandRows = 64;
+
+static thread_local WorkStealingPool *currentPool = nullptr;
+static thread_local unsigned int currentWorker = 0;
+
+WorkDeque::WorkDeque() {
+    rings.emplace_back(new Ring(64));
+    ring.store(rings.back().get(), std::memory_order_relaxed);
+}
+
+WorkDeque::~WorkDeque() {
+    Ring *current = ring.load(std::memory_order_relaxed);
+
+    for (long i = top.load(std::memory_order_relaxed); i < bottom.load(std::memory_order_relaxed); i++)
+        delete current->Get(i);
+}
+
+void WorkDeque::Push(Task *task) {
+    long b = bottom.load(std::memory_order_relaxed);
+    long t = top.load(std::memory_order_acquire);
+    Ring *current = ring.load(std::memory_order_relaxed);
+
+    if (b - t > current->capacity - 1) {
+        rings.emplace_back(new Ring(current->capacity * 2));
+
+        for (long i = t; i < b; i++)
+            rings.back()->Put(i, current->Get(i));
+
+        current = rings.back().get();
+        ring.store(current, std::memory_order_release);
+    }
+
+    current->Put(b, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+WorkDeque::Task *WorkDeque::Pop() {
+    long b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring *current = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {                                                     // Empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Task *task = current->Get(b);
+
+    if (t == b) {                                                    // Last task, thieves may be after it too
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            task = nullptr;
+
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+}
+
+WorkDeque::Task *WorkDeque::Steal() {
+    long t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return nullptr;
+
+    Task *task = ring.load(std::memory_order_acquire)->Get(t);
+
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+
+    return task;
+}
+
+WorkStealingPool::WorkStealingPool(unsigned int threads) {
+    for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+        deques.emplace_back(new WorkDeque());
+
+    for (unsigned int i = 0; i < deques.size(); i++)
+        workers.emplace_back(&WorkStealingPool::work, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        // Waits like Wait, exceptions nobody asked for are dropped
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return unfinished.load() == 0; });
+        stopping = true;
+    }
+
+    ready.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void WorkStealingPool::push(Task *task) {
+    unfinished++;
+
+    if (currentPool == this) {
+        deques[currentWorker]->Push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(mutex);
+        injected.push_back(task);
+    }
+
+    // Sleeping workers count themselves before looking at queued, so one of the two sides always sees the other
+    queued++;
+
+    if (sleeping.load() > 0) {
+        { std::lock_guard<std::mutex> lock(mutex); }
+        ready.notify_one();
+    }
+}
+
+WorkStealingPool::Task *WorkStealingPool::find(unsigned int self) {
+    Task *task = deques[self]->Pop();
+
+    if (!task) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!injected.empty()) {
+            task = injected.front();
+            injected.pop_front();
+        }
+    }
+
+    for (unsigned int i = 1; !task && i < deques.size(); i++)
+        task = deques[(self + i) % deques.size()]->Steal();
+
+    if (task)
+        queued--;
+
+    return task;
+}
+
+void WorkStealingPool::execute(Task *task) {
+    std::exception_ptr error;
+
+    try {
+        (*task)();
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    delete task;
+
+    if (error) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!failure)
+            failure = error;
+    }
+
+    if (unfinished.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.notify_all();
+    }
+}
+
+void WorkStealingPool::work(unsigned int self) {
+    currentPool = this;
+    currentWorker = self;
+
+    while (true) {
+        Task *task = find(self);
+
+        if (task) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping++;
+        ready.wait(lock, [this]() { return stopping || queued.load() > 0; });
+        sleeping--;
+
+        if (stopping && queued.load() <= 0)
+            return;
+    }
+}
+
+void WorkStealingPool::Submit(std::function<void()> task) {
+    push(new Task(std::move(task)));
+}
+
+void WorkStealingPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return unfinished.load() == 0; });
+
+    if (failure)
+        std::rethrow_exception(std::exchange(failure, nullptr));
+}
+
+void WorkStealingPool::blendRows(int begin, int end, const std::function<void(int, int)> &body, Join &join) {
+    WorkDeque &own = *deques[currentWorker];
+
+    while (begin < end) {
+        // Nobody is busy with what was offered before, so offer half of the rest
+        if (end - begin >= 2 * bandRows && deques.size() > 1 && own.Empty()) {
+            int middle = begin + (end - begin) / 2;
+            join.pending++;
+
+            push(new Task([this, middle, end, &body, &join]() {
+                std::exception_ptr error;
+
+                try {
+                    blendRows(middle, end, body, join);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                // Waiter looks at pending under the same lock, so join is not destroyed before this is done with it
+                std::lock_guard<std::mutex> lock(join.mutex);
+
+                if (error && !join.failure)
+                    join.failure = error;
+
+                if (join.pending.fetch_sub(1, std::memory_order_release) == 1)
+                    join.finished.notify_one();
+            }));
+
+            end = middle;
+            continue;
+        }
+
+        int bandEnd = std::min(begin + bandRows, end);
+        body(begin, bandEnd);
+        begin = bandEnd;
+    }
+}
+
+void WorkStealingPool::Blend(BitMapImage &background, const BitMapImage &foreground, unsigned int x, unsigned int y,
+                             const BlendOptions &options) {
+    if (background.Format() != foreground.Format())
+        throw std::runtime_error("Pixel formats of images must match");
+
+    if (currentPool != this) {                                       // Only workers have deques to split into
+        std::mutex waiting;
+        std::condition_variable finished;
+        bool done = false;
+        std::exception_ptr failure;
+
+        Submit([&]() {
+            try {
+                Blend(background, foreground, x, y, options);
+            } catch (...) {
+                failure = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(waiting);
+            done = true;
+            finished.notify_one();
+        });
+
+        std::unique_lock<std::mutex> lock(waiting);
+        finished.wait(lock, [&]() { return done; });
+
+        if (failure)
+            std::rethrow_exception(failure);
+
+        return;
+    }
+
+    // Whole call is one blend, bands are not timed on their own
+    std::optional<LatencyMetrics::Timer> timer;
+
+    if (static_cast<size_t>(foreground.Width()) * foreground.Height() >= BitMapImage::timedBlendPixels)
+        timer.emplace(LatencyMetrics::Blend);
+
+    background.MarkModified();
+    const size_t rowSize = static_cast<size_t>(foreground.Width()) * BitMapImage::BytesPerPixel(foreground.Format());
+    const int last = std::min<long long>(static_cast<long long>(y) + foreground.Height(), background.Height());
+    unsigned char *pixels = const_cast<unsigned char *>(foreground.Pixels());
+
+    // Rows of foreground landing on the band, borrowed without copying. Not a lambda, bands given away refer to it
+    std::function<void(int, int)> body = [&](int begin, int end) {
+        BitMapImage rows(foreground.Width(), end - begin, pixels + (begin - y) * rowSize, foreground.Format());
+        background.blend(rows, x, begin, options);
+    };
+
+    Join join;
+
+    try {
+        blendRows(y, last, body, join);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(join.mutex);
+
+        if (!join.failure)
+            join.failure = std::current_exception();
+    }
+
+    // Bands left in own deque come back here, stolen ones are waited for by running other tasks meanwhile
+    while (join.pending.load(std::memory_order_acquire) > 0) {
+        Task *task = find(currentWorker);
+
+        if (!task)
+            break;
+
+        execute(task);
+    }
+
+    // Nothing left to take, the rest of the bands are being blended by thieves
+    std::unique_lock<std::mutex> lock(join.mutex);
+    join.finished.wait(lock, [&]() { return join.pending.load(std::memory_order_acquire) == 0; });
+
+    if (join.failure)
+        std::rethrow_exception(join.failure);
+}
@@ -0,0 +1,108 @@
+#ifndef ALPHABLENDING_WORKSTEALINGPOOL_H
+#define ALPHABLENDING_WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "BitMapImage.h"
+
+/*
+ * Chase-Lev deque of tasks (Le, Pop, Cohen, Zappa Nardelli, "Correct and efficient work-stealing for weak memory
+ * models"). Only the owner pushes and pops at the bottom, any thread may steal from the top, none of them locks.
+ * Ring grows by doubling, old rings are kept until destruction, because thieves may still be reading them.
+ */
+class WorkDeque {
+public:
+    using Task = std::function<void()>;
+
+private:
+    struct Ring {
+        long capacity;                                               // Power of two
+        std::unique_ptr<std::atomic<Task *>[]> slots;
+
+        explicit Ring(long capacity) : capacity(capacity), slots(new std::atomic<Task *>[capacity]) {}
+
+        Task *Get(long index) const { return slots[index & (capacity - 1)].load(std::memory_order_relaxed); }
+        void Put(long index, Task *task) { slots[index & (capacity - 1)].store(task, std::memory_order_relaxed); }
+    };
+
+    std::atomic<long> top{0};
+    std::atomic<long> bottom{0};
+    std::atomic<Ring *> ring;
+    std::vector<std::unique_ptr<Ring>> rings;                        // Current one is the last
+
+public:
+    WorkDeque();
+    WorkDeque(const WorkDeque &other) = delete;
+    WorkDeque &operator=(const WorkDeque &other) = delete;
+    ~WorkDeque();                                                    // Deletes tasks nobody took
+
+    void Push(Task *task);                                           // Owner only
+    Task *Pop();                                                     // Owner only, newest task or nullptr
+    Task *Steal();                                                   // Oldest task, nullptr if empty or lost a race
+
+    bool Empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Thread pool for jobs of very different sizes. Every worker keeps its tasks in its own deque and takes the newest one,
+ * idle workers steal the oldest ones from others, tasks submitted from outside go through one shared queue. Blend
+ * called on the pool splits the rows of foreground on demand: while the deque of the worker is empty it pushes the
+ * second half of what is left for thieves, otherwise it goes on with bands of 64 rows itself, so small blends are
+ * never split and big ones are spread over exactly as many workers as are idle. While waiting for its bands to be
+ * finished the worker runs other tasks, and blocks only once there are none left to take.
+ */
+class WorkStealingPool {
+private:
+    using Task = WorkDeque::Task;
+
+    struct Join {                                                    // Bands of one Blend not finished yet
+        std::atomic<int> pending{0};                                 // Only ever decremented under mutex
+        std::mutex mutex;
+        std::condition_variable finished;                            // Signaled by the last band
+        std::exception_ptr failure;
+    };
+
+    std::vector<std::unique_ptr<WorkDeque>> deques;
+    std::vector<std::thread> workers;
+    std::deque<Task *> injected;                                     // Tasks submitted from other threads
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable idle;
+    std::atomic<long> queued{0};                                     // Tasks waiting in deques and injected
+    std::atomic<size_t> unfinished{0};                               // Tasks not finished, for Wait
+    std::atomic<unsigned int> sleeping{0};
+    bool stopping = false;
+    std::exception_ptr failure;                                      // First exception of a task, under mutex
+
+    void push(Task *task);
+    Task *find(unsigned int self);                                   // Own deque, then injected, then steal
+    void execute(Task *task);
+    void work(unsigned int self);
+    void blendRows(int begin, int end, const std::function<void(int, int)> &body, Join &join);
+
+public:
+    explicit WorkStealingPool(unsigned int threads);
+    WorkStealingPool(const WorkStealingPool &other) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &other) = delete;
+    ~WorkStealingPool();                                             // Finishes all tasks and joins workers
+
+    void Submit(std::function<void()> task);                        // From a task it goes to deque of its worker
+    void Wait();                                                     // Until all tasks are done, not from a task,
+                                                                     // then rethrows the first exception of a task
+
+    void Blend(BitMapImage &background, const BitMapImage &foreground, unsigned int x, unsigned int y,
+               const BlendOptions &options = BlendOptions());        // Blend in bands stolen by idle workers
+
+    unsigned int Threads() const { return workers.size(); }
+};
+
+#endif //ALPHABLENDING_WORKSTEALINGPOOL_H
@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include "BitMapImage.h"
+#include "KernelTuning.h"
+#include "alphablend.h"
+
+static thread_local std::string lastError;
+
+static ab_status fail(ab_status status, const char *message) {
+    lastError = message;
+    return status;
+}
+
+static bool validImage(const ab_image *image) {
+    return image && image->pixels && image->width > 0 && image->height > 0;
+}
+
+// Options of older callers are shorter, missing fields keep their defaults
+static BlendOptions convertOptions(const ab_blend_options *options) {
+    ab_blend_options full;
+    ab_blend_options_init(&full);
+
+    if (options)
+        memcpy(&full, options, std::min<size_t>(options->struct_size, sizeof(full)));
+
+    BlendOptions converted;
+    converted.opacity = full.opacity;
+    converted.tintRed = full.tint_red;
+    converted.tintGreen = full.tint_green;
+    converted.tintBlue = full.tint_blue;
+    converted.linearLight = full.linear_light != 0;
+    converted.exact = full.exact != 0;
+    return converted;
+}
+
+extern "C" {
+
+uint32_t ab_api_version(void) {
+    return AB_API_VERSION;
+}
+
+const char *ab_last_error(void) {
+    return lastError.c_str();
+}
+
+void ab_blend_options_init(ab_blend_options *options) {
+    if (!options)
+        return;
+
+    options->struct_size = sizeof(ab_blend_options);
+    options->opacity = 255;
+    options->tint_red = 255;
+    options->tint_green = 255;
+    options->tint_blue = 255;
+    options->linear_light = 0;
+    options->exact = 0;
+}
+
+ab_status ab_load(const char *path, uint8_t *pixels, size_t capacity, int32_t *width, int32_t *height) {
+    if (!path || !width || !height)
+        return fail(AB_ERROR_ARGUMENT, "Path and size outputs must not be null");
+
+    std::unique_ptr<FILE, int (*)(FILE *)> probe(fopen(path, "rb"), &fclose);
+
+    if (!probe)
+        return fail(AB_ERROR_IO, "Cannot open file");
+
+    probe.reset();
+
+    try {
+        BitMapImage image(path);
+        size_t size = static_cast<size_t>(image.Width()) * image.Height() * 4;
+        *width = image.Width();
+        *height = image.Height();
+
+        if (!pixels || capacity < size)
+            return fail(AB_ERROR_BUFFER_TOO_SMALL, "Buffer is too small for the image");
+
+        memcpy(pixels, image.Pixels(), size);
+    } catch (const std::bad_alloc &) {
+        return fail(AB_ERROR_INTERNAL, "Out of memory");
+    } catch (const std::exception &error) {
+        return fail(AB_ERROR_FORMAT, error.what());
+    }
+
+    return AB_OK;
+}
+
+ab_status ab_blend(const ab_image *background, const ab_image *foreground, int32_t x, int32_t y,
+                   const ab_blend_options *options) {
+    if (!validImage(background) || !validImage(foreground))
+        return fail(AB_ERROR_ARGUMENT, "Images must have pixels and positive size");
+
+    if (options && options->struct_size < sizeof(uint32_t))
+        return fail(AB_ERROR_ARGUMENT, "Blend options are not initialized");
+
+    if (x < 0 || y < 0 || foreground->width > background->width - x || foreground->height > background->height - y)
+        return fail(AB_ERROR_ARGUMENT, "Foreground does not fit into background");
+
+    try {
+        BitMapImage bkg(background->width, background->height, background->pixels);
+        const BitMapImage frg(foreground->width, foreground->height, foreground->pixels);
+        bkg.Blend(frg, x, y, convertOptions(options));
+    } catch (const std::exception &error) {
+        return fail(AB_ERROR_INTERNAL, error.what());
+    }
+
+    return AB_OK;
+}
+
+ab_status ab_patch_file(const char *path, const ab_image *foreground, int32_t x, int32_t y,
+                        const ab_blend_options *options) {
+    if (!path || !validImage(foreground) || x < 0 || y < 0)
+        return fail(AB_ERROR_ARGUMENT, "Path and foreground must be valid");
+
+    if (options && options->struct_size < sizeof(uint32_t))
+        return fail(AB_ERROR_ARGUMENT, "Blend options are not initialized");
+
+    try {
+        const BitMapImage frg(foreground->width, foreground->height, foreground->pixels);
+        BitMapImage::PatchFile(path, frg, x, y, convertOptions(options));
+    } catch (const std::exception &error) {
+        return fail(AB_ERROR_IO, error.what());
+    }
+
+    return AB_OK;
+}
+
+ab_status ab_save(const char *path, const ab_image *image) {
+    if (!path || !validImage(image))
+        return fail(AB_ERROR_ARGUMENT, "Path and image must be valid");
+
+    try {
+        const BitMapImage view(image->width, image->height, image->pixels);
+        view.Save(path);
+    } catch (const std::exception &error) {
+        return fail(AB_ERROR_IO, error.what());
+    }
+
+    return AB_OK;
+}
+
+void ab_set_kernel_calibration(int enabled) {
+    setKernelCalibration(enabled != 0);
+}
+
+}
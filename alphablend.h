@@ -0,0 +1,86 @@
+#ifndef ALPHABLENDING_ALPHABLEND_H
+#define ALPHABLENDING_ALPHABLEND_H
+
+/*
+ * Stable C interface of libalphablend. Pixels are always owned by the caller: 8-bit BGRA, rows stored one after
+ * another without padding. Functions never throw, they return status and keep description of the last error
+ * per thread. New fields of ab_blend_options are only ever appended, struct_size tells which of them are set.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AB_API_VERSION 1
+
+/* Library is built with hidden visibility, only functions declared here are exported */
+#if defined(__GNUC__)
+#define AB_EXPORT __attribute__((visibility("default")))
+#else
+#define AB_EXPORT
+#endif
+
+typedef enum ab_status {
+    AB_OK = 0,
+    AB_ERROR_ARGUMENT = 1,               /* Null pointer, bad size or foreground outside of background */
+    AB_ERROR_IO = 2,                     /* File cannot be opened or created */
+    AB_ERROR_FORMAT = 3,                 /* File is neither a supported BMP nor QOI */
+    AB_ERROR_BUFFER_TOO_SMALL = 4,       /* Size of the image is reported, call again with a bigger buffer */
+    AB_ERROR_INTERNAL = 5
+} ab_status;
+
+typedef struct ab_image {
+    int32_t width;
+    int32_t height;
+    uint8_t *pixels;                     /* width * height * 4 bytes */
+} ab_image;
+
+typedef struct ab_blend_options {
+    uint32_t struct_size;                /* sizeof(ab_blend_options) at compile time of the caller */
+    uint8_t opacity;                     /* Multiplies alpha of every foreground pixel */
+    uint8_t tint_red;                    /* Multiply foreground channels, 255 keeps them as is */
+    uint8_t tint_green;
+    uint8_t tint_blue;
+    uint8_t linear_light;                /* Blend in linear light instead of sRGB */
+    uint8_t exact;                       /* Divide by 255 with rounding instead of shifting by 8 */
+} ab_blend_options;
+
+AB_EXPORT uint32_t ab_api_version(void);
+
+/* Description of the last failure on the calling thread, empty if there was none */
+AB_EXPORT const char *ab_last_error(void);
+
+/* Fills options with defaults: opaque, untinted, fast sRGB blending */
+AB_EXPORT void ab_blend_options_init(ab_blend_options *options);
+
+/*
+ * Decodes BMP or QOI file into pixels. Width and height are always reported when the header is valid, so passing null
+ * pixels with zero capacity queries the size of the buffer needed.
+ */
+AB_EXPORT ab_status ab_load(const char *path, uint8_t *pixels, size_t capacity, int32_t *width, int32_t *height);
+
+/* Blends foreground onto background at (x, y), foreground has to fit into background. Options may be null */
+AB_EXPORT ab_status ab_blend(const ab_image *background, const ab_image *foreground, int32_t x, int32_t y,
+                             const ab_blend_options *options);
+
+/* Blends foreground into 32-bit BMP file in place, reading and writing only the pixels it covers */
+AB_EXPORT ab_status ab_patch_file(const char *path, const ab_image *foreground, int32_t x, int32_t y,
+                                  const ab_blend_options *options);
+
+/* Saves BMP file, or QOI if path ends with .qoi */
+AB_EXPORT ab_status ab_save(const char *path, const ab_image *image);
+
+/*
+ * Without a cached tuning for this processor the first blend times all kernel variants, which takes about 50 ms.
+ * Passing 0 before the first blend skips that and uses cached tuning or the default kernel. Same as ALPHABLEND_TUNE=0
+ */
+AB_EXPORT void ab_set_kernel_calibration(int enabled);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ALPHABLENDING_ALPHABLEND_H */
@@ -1,405 +1,955 @@
+#include <cerrno>
 #include <cstdio>
-#include <memory>
+#include <cstdlib>
 #include <cstring>
-#include <immintrin.h>
-
-const unsigned int BMP_FILE_HEADER_SIZE = 14;
-const unsigned int BMP_V4_HEADER_SIZE = 108;
-const unsigned int BMP_V5_HEADER_SIZE = 124;
+#include <cmath>
+#include <stdexcept>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "BitMapImage.h"
+#include "KernelTuning.h"
+#include "BlendServer.h"
+#include "ImageCache.h"
+#include "Watermark.h"
+#include "SpriteAtlas.h"
+#include "MipPyramid.h"
+#include "NumaPool.h"
+#include "WorkStealingPool.h"
+#include "LatencyMetrics.h"
 
 using std::unique_ptr;
 
-struct free_deleter {
-    template<typename T>
-    void operator()(T *p) const {
-        std::free(const_cast<std::remove_const_t<T> *>(p));
+// Fill image with reproducible noise, so that alpha takes every value
+static void fillNoise(BitMapImage &img, unsigned int seed) {
+    unsigned char *pixels = img.Pixels();
+    size_t size = static_cast<size_t>(img.Width()) * img.Height() * 4;
+
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        pixels[i] = seed >> 16;
     }
-};
+}
+
+static double timeBlends(BitMapImage &bkg, const BitMapImage &frg, int iterations) {
+    auto start = std::chrono::steady_clock::now();
 
-template<typename T>
-void bufWrite(const unique_ptr<unsigned char[]> &out, T value, size_t &offset) {
-    memcpy(out.get() + offset, &value, sizeof(T));
-    offset += sizeof(T);
+    for (int i = 0; i < iterations; i++)
+        bkg.Blend(frg, 0, 0);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
 }
 
-class bufferWriter {
-private:
-    const unique_ptr<unsigned char[]> &out;
-    size_t offset;
-public:
-    bufferWriter(const unique_ptr<unsigned char[]> &out) : out(out), offset(0) {}
+// Compare regular and streaming stores on composites of growing size
+static int benchStreaming() {
+    const int sides[] = {512, 1024, 2048, 4096, 8192};
+
+    printf("LLC size: %zu bytes\n", detectCacheSize());
+    printf("%6s %14s %14s\n", "side", "cached GB/s", "streamed GB/s");
+
+    for (int side : sides) {
+        BitMapImage bkg(side, side);
+        BitMapImage frg(side, side);
+        fillNoise(bkg, 1);
+        fillNoise(frg, 2);
 
-    ~bufferWriter() = default;
+        size_t area = static_cast<size_t>(side) * side * 4;
+        int iterations = static_cast<int>((size_t(2) << 30) / area) + 1;
+        double traffic = 3.0 * area * iterations / 1e9;       // Two loads and one store per pixel
 
-    template<typename T>
-    void operator()(T value) {
-        bufWrite(out, value, offset);
+        BitMapImage::SetStreamingThreshold(SIZE_MAX);
+        timeBlends(bkg, frg, 1);
+        double cached = timeBlends(bkg, frg, iterations);
+
+        BitMapImage::SetStreamingThreshold(0);
+        timeBlends(bkg, frg, 1);
+        double streamed = timeBlends(bkg, frg, iterations);
+
+        printf("%6d %14.2f %14.2f\n", side, traffic / cached, traffic / streamed);
     }
-};
 
-template<typename T>
-void parseValue(T &to, const unique_ptr<unsigned char[]> &arr, size_t &offset) {
-    to = *reinterpret_cast<T *>(arr.get() + offset);
-    offset += sizeof(T);
+    BitMapImage::SetStreamingThreshold(SIZE_MAX);
+    return 0;
 }
 
-class parserWrapper {
-private:
-    size_t &offset;
-    const unique_ptr<unsigned char[]> &arr;
+// Throughput of every blending mode on a cache-resident sprite, plus cost of format conversions
+static int benchBlend() {
+    struct Mode {
+        const char *name;
+        PixelFormat format;
+        BlendOptions options;
+    };
+
+    BlendOptions faded;
+    faded.opacity = 200;
+    faded.tintRed = 128;
 
-public:
-    template<typename T>
-    void operator()(T &dst) {
-        parseValue(dst, arr, offset);
-    }
+    BlendOptions linear;
+    linear.linearLight = true;
 
-    parserWrapper(size_t &offset, const unique_ptr<unsigned char[]> &arr) : arr(arr), offset(offset) {}
+    BlendOptions exact;
+    exact.exact = true;
 
-    ~parserWrapper() = default;
-};
+    BlendOptions exactFaded = faded;
+    exactFaded.exact = true;
 
-class BitMapImage {
-    struct CIEXYZ {
-        unsigned int ciexyzX;
-        unsigned int ciexyzY;
-        unsigned int ciexyzZ;
+    const Mode modes[] = {
+            {"8-bit",            PixelFormat::BGRA8,   BlendOptions()},
+            {"8-bit opacity",    PixelFormat::BGRA8,   faded},
+            {"8-bit exact",      PixelFormat::BGRA8,   exact},
+            {"8-bit exact fade", PixelFormat::BGRA8,   exactFaded},
+            {"16-bit",           PixelFormat::BGRA16,  BlendOptions()},
+            {"float",            PixelFormat::BGRA32F, BlendOptions()},
+            {"8-bit linear",     PixelFormat::BGRA8,   linear},
     };
 
-    struct CIEXYZTRIPLE {
-        CIEXYZ ciexyzRed;
-        CIEXYZ ciexyzGreen;
-        CIEXYZ ciexyzBlue;
-    };
+    const int side = 512;
+    const int iterations = 2000;
+
+    printf("%-18s %12s\n", "mode", "Mpixel/s");
+
+    for (const Mode &mode : modes) {
+        BitMapImage bkg(1024, 1024);
+        BitMapImage frg(side, side);
+        fillNoise(bkg, 1);
+        fillNoise(frg, 2);
+        bkg.ConvertTo(mode.format);
+        frg.ConvertTo(mode.format);
+
+        bkg.Blend(frg, 3, 5, mode.options);
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < iterations; i++)
+            bkg.Blend(frg, 3, 5, mode.options);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-18s %12.1f\n", mode.name, static_cast<double>(side) * side * iterations / elapsed.count() / 1e6);
+    }
+
+    {
+        BitMapImage bkg(1024, 1024);
+        BitMapImage inflated(side, side);
+        fillNoise(bkg, 1);
+        fillNoise(inflated, 2);
+
+        std::vector<unsigned char> coverage(side * side);
+
+        for (int i = 0; i < side * side; i++)
+            coverage[i] = inflated.Pixels()[i * 4 + 3];
+
+        const AlphaMask mask = {side, side, coverage.data()};
+        const Color color = {255, 128, 0};
+
+        for (int i = 0; i < side * side; i++) {
+            inflated.Pixels()[i * 4] = color.blue;
+            inflated.Pixels()[i * 4 + 1] = color.green;
+            inflated.Pixels()[i * 4 + 2] = color.red;
+        }
+
+        auto start = std::chrono::steady_clock::now();
 
-private:
-    unsigned int fileSize;
-    unsigned int offBits;
-    unsigned int structSize;
-    int width;
-    int height;
-    unsigned short planes;
-    unsigned short bitCount;
-    unsigned int compression;
-    unsigned int imageSize;
-    int Xppm;
-    int Yppm;
-    unsigned int clrUsed;
-    unsigned int clrImportant;
-    unsigned int redMask;
-    unsigned int greenMask;
-    unsigned int blueMask;
-    unsigned int alphaMask;
-    unsigned int CSType;
-    unique_ptr<unsigned char[], free_deleter> image;
-public:
-
-    explicit BitMapImage(const char *filename);                      // Default constructor loading image
-    void deepCopy(const BitMapImage &other);                         // Actually copy assignment
-    BitMapImage(BitMapImage &&other) noexcept;                       // Move constructor
-    BitMapImage(const BitMapImage &other) = delete;                  // Implicit copying is prohibited
-    BitMapImage &
-    operator=(const BitMapImage &other) = delete;       // No implicit copying in order to avoid memory issues
-    BitMapImage &operator=(BitMapImage &&other);                     // Move assignment
-    ~BitMapImage() noexcept = default;                               // Destructor
-
-    void Blend(const BitMapImage &foreground, unsigned int x,
-               unsigned int y);       // Use alpha-blending to add picture on top
-    void Save(const char *filename);                        // Save BMP picture to file
-};
-
-void BitMapImage::deepCopy(const BitMapImage &other) {
-    fileSize = other.fileSize;
-    offBits = other.offBits;
-    structSize = other.structSize;
-    width = other.width;
-    height = other.height;
-    planes = other.planes;
-    bitCount = other.bitCount;
-    compression = other.compression;
-    imageSize = other.imageSize;
-    Xppm = other.Xppm;
-    Yppm = other.Yppm;
-    clrUsed = other.clrUsed;
-    clrImportant = other.clrImportant;
-    redMask = other.redMask;
-    greenMask = other.greenMask;
-    blueMask = other.blueMask;
-    alphaMask = other.alphaMask;
-    CSType = other.CSType;
-
-    image.reset(static_cast<unsigned char *>(aligned_alloc(32, width * height * 4)));
-    memcpy(image.get(), other.image.get(), width * height * 4);
+        for (int i = 0; i < iterations; i++)
+            bkg.BlendMask(mask, color, 3, 5);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-18s %12.1f\n", "8-bit mask", static_cast<double>(side) * side * iterations / elapsed.count() / 1e6);
+
+        start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < iterations; i++)
+            bkg.BlendMasked(inflated, mask, 3, 5);
+
+        elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-18s %12.1f\n", "8-bit masked", static_cast<double>(side) * side * iterations / elapsed.count() / 1e6);
+    }
+
+    const PixelFormat wide[] = {PixelFormat::BGRA16, PixelFormat::BGRA32F};
+    const char *wideNames[] = {"16-bit", "float"};
+
+    for (int i = 0; i < 2; i++) {
+        BitMapImage img(2048, 2048);
+        fillNoise(img, 3);
+
+        auto start = std::chrono::steady_clock::now();
+        img.ConvertTo(wide[i]);
+        auto middle = std::chrono::steady_clock::now();
+        img.ConvertTo(PixelFormat::BGRA8);
+        auto end = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double> widen = middle - start;
+        std::chrono::duration<double> narrow = end - middle;
+        printf("8-bit -> %-7s %8.1f Mpixel/s, back %8.1f Mpixel/s\n", wideNames[i], 2048.0 * 2048 / widen.count() / 1e6,
+               2048.0 * 2048 / narrow.count() / 1e6);
+    }
+
+    return 0;
 }
 
+// One watermark onto a stream of distinct full HD backgrounds, plain Blend against prepared Watermark
+static int benchWatermark() {
+    const int count = 64;
+    const int rounds = 10;
+    BitMapImage frg(256, 128);
+    fillNoise(frg, 7);
+
+    for (int ycur = 0; ycur < frg.Height(); ycur++)                  // Transparent left third, like text with margins
+        for (int xcur = 0; xcur < frg.Width() / 3; xcur++)
+            frg.Pixels()[(ycur * frg.Width() + xcur) * 4 + 3] = 0;
+
+    std::vector<std::unique_ptr<BitMapImage>> images;
+    std::vector<BitMapImage *> backgrounds;
 
-BitMapImage::BitMapImage(BitMapImage &&other) noexcept {
-    std::swap(*this, other);
+    for (int i = 0; i < count; i++) {
+        images.emplace_back(new BitMapImage(1920, 1080));
+        fillNoise(*images.back(), 100 + i);
+        backgrounds.push_back(images.back().get());
+    }
+
+    BitMapImage check(1920, 1080);
+    check.deepCopy(*backgrounds[0]);
+
+    Watermark watermark(frg);
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    auto measure = [&](const char *name, const std::function<void()> &run) {
+        run();
+        auto start = std::chrono::steady_clock::now();
+
+        for (int round = 0; round < rounds; round++)
+            run();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-22s %12.0f images/s\n", name, count * rounds / elapsed.count());
+    };
+
+    measure("Blend", [&]() {
+        for (BitMapImage *background : backgrounds)
+            background->Blend(frg, 1600, 900);
+    });
+    measure("Watermark", [&]() {
+        for (BitMapImage *background : backgrounds)
+            watermark.Apply(*background, 1600, 900);
+    });
+    measure("Watermark, threads", [&]() {
+        watermark.ApplyMany(backgrounds.data(), backgrounds.size(), 1600, 900, pool);
+    });
+
+    for (int i = 0; i < 3 * (rounds + 1); i++)
+        check.Blend(frg, 1600, 900);
+
+    if (memcmp(check.Pixels(), backgrounds[0]->Pixels(), static_cast<size_t>(1920) * 1080 * 4) != 0) {
+        fprintf(stderr, "Watermark result differs from Blend\n");
+        return 1;
+    }
+
+    return 0;
 }
 
-BitMapImage &BitMapImage::operator=(BitMapImage &&other) {
-    std::swap(*this, other);
-    return *this;
+// Blending of small square sprites, specialized kernels against the generic path
+static int benchSprites() {
+    const int sides[] = {16, 32, 64};
+    const int iterations = 1000000;
+    BitMapImage bkg(1024, 1024);
+    fillNoise(bkg, 1);
+
+    printf("%-8s %14s %14s\n", "sprite", "generic ns", "fixed ns");
+
+    for (int side : sides) {
+        BitMapImage frg(side, side);
+        fillNoise(frg, side);
+        double nanoseconds[2] = {};
+
+        for (int fixed = 1; fixed >= 0; fixed--) {
+            BitMapImage::SetFixedSizeSprites(fixed);
+            unsigned int position = 12345;
+            auto start = std::chrono::steady_clock::now();
+
+            for (int i = 0; i < iterations; i++) {
+                position = position * 1103515245 + 12345;                // Spread sprites like markers on a map
+                bkg.Blend(frg, (position >> 8) % (1024 - side), (position >> 18) % (1024 - side));
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            nanoseconds[fixed] = elapsed.count() / iterations * 1e9;
+        }
+
+        printf("%2dx%-5d %14.1f %14.1f\n", side, side, nanoseconds[0], nanoseconds[1]);
+    }
+
+    BitMapImage::SetFixedSizeSprites(true);
+    return 0;
 }
 
-BitMapImage::BitMapImage(const char *filename) {
-    unique_ptr<unsigned char[]> bitmapFileHeader = std::make_unique<unsigned char[]>(
-            BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE);
+// Icons loaded one file each against one atlas, then blended at random positions
+static int benchAtlas() {
+    const int icons = 256, side = 24, perRow = 16;
+    const int iterations = 1000000;
+    BitMapImage sheet(perRow * side, icons / perRow * side);
+    fillNoise(sheet, 7);
+
+    FILE *manifest = fopen("bench-atlas.txt", "w");
+
+    if (!manifest) {
+        fprintf(stderr, "Cannot create bench-atlas.txt\n");
+        return 1;
+    }
+
+    for (int i = 0; i < icons; i++) {
+        int x = i % perRow * side, y = i / perRow * side;
+        BitMapImage icon(side, side);
+
+        for (int row = 0; row < side; row++)
+            memcpy(icon.Pixels() + row * side * 4, sheet.Pixels() + ((y + row) * sheet.Width() + x) * 4, side * 4);
+
+        icon.Save(("bench-icon-" + std::to_string(i) + ".bmp").c_str());
+        fprintf(manifest, "icon%d %d %d %d %d\n", i, x, y, side, side);
+    }
 
-    unique_ptr<FILE, int (*)(FILE *)> input(fopen(filename, "rb"), &fclose);
+    fclose(manifest);
+    sheet.Save("bench-atlas.bmp");
 
-    fread(bitmapFileHeader.get(), sizeof(unsigned char), BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE,
-          input.get());      // Read file header with BMP V4 Image header
+    const int loads = 20;
+    std::vector<unique_ptr<BitMapImage>> separate;
+    auto start = std::chrono::steady_clock::now();
 
-    size_t offset = 0;
+    for (int load = 0; load < loads; load++) {
+        separate.clear();
 
-    unsigned short signature = 0;
+        for (int i = 0; i < icons; i++)
+            separate.emplace_back(new BitMapImage(("bench-icon-" + std::to_string(i) + ".bmp").c_str()));
+    }
 
-    auto fileHeaderParser = parserWrapper(offset, bitmapFileHeader);
+    auto middle = std::chrono::steady_clock::now();
 
-    fileHeaderParser(signature);
+    for (int load = 0; load < loads; load++)
+        SpriteAtlas loaded("bench-atlas.bmp", "bench-atlas.txt");
 
-    if (signature == 0x424d)
-        throw std::runtime_error("Big-endian format is not yet supported");
+    auto end = std::chrono::steady_clock::now();
+    SpriteAtlas atlas("bench-atlas.bmp", "bench-atlas.txt");
 
-    if (signature != 0x4d42)
-        throw std::runtime_error("Invalid file signature");
+    std::chrono::duration<double> separateLoad = middle - start;
+    std::chrono::duration<double> atlasLoad = end - middle;
+    printf("load %d icons: %.2f ms from files, %.2f ms from atlas\n", icons, separateLoad.count() / loads * 1e3,
+           atlasLoad.count() / loads * 1e3);
 
-    fileHeaderParser(fileSize);
+    BitMapImage bkg(1024, 1024);
+    fillNoise(bkg, 1);
+    double nanoseconds[2] = {};
 
-    offset += 4;
+    for (int fromAtlas = 0; fromAtlas < 2; fromAtlas++) {
+        unsigned int position = 12345;
+        start = std::chrono::steady_clock::now();
 
-    fileHeaderParser(offBits);           // Read offset to the beginning of the image
-    fileHeaderParser(structSize);       // Read structure size
+        for (int i = 0; i < iterations; i++) {
+            position = position * 1103515245 + 12345;
+            const BitMapImage &icon = fromAtlas ? atlas.Sprite((position >> 4) % icons)
+                                                : *separate[(position >> 4) % icons];
+            bkg.Blend(icon, (position >> 8) % (1024 - side), (position >> 18) % (1024 - side));
+        }
 
-    if (structSize < 108)
-        throw std::runtime_error("Only BMP v4 and BMP v5 are supported");
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        nanoseconds[fromAtlas] = elapsed.count() / iterations * 1e9;
+    }
 
-    fileHeaderParser(width);                 // Read image width
-    fileHeaderParser(height);           // Read image height
-    fileHeaderParser(planes);           // Read number of planes
+    printf("blend random icon: %.1f ns from files, %.1f ns from atlas\n", nanoseconds[0], nanoseconds[1]);
 
-    if (planes != 1)
-        throw std::runtime_error("Invalid number of planes (Must be 1)");
+    for (int i = 0; i < icons; i++)
+        remove(("bench-icon-" + std::to_string(i) + ".bmp").c_str());
 
-    fileHeaderParser(bitCount);         // Read depth of image
+    remove("bench-atlas.bmp");
+    remove("bench-atlas.txt");
+    return 0;
+}
 
-    if (bitCount != 32)
-        throw std::runtime_error("Only 32-bit pixels are supported");
+// Compare size and speed of QOI against BMP on a real picture
+static int benchQoi(const char *filename) {
+    const int iterations = 50;
+    const char *qoiName = "bench.qoi";
+    BitMapImage original(filename);
+    original.SaveQoi(qoiName);
 
-    fileHeaderParser(compression);      // Read compression type
+    auto timeLoads = [&](const char *name) {
+        auto start = std::chrono::steady_clock::now();
 
-    if (compression != 6 && compression != 3)
-        throw std::runtime_error("Only images with bitmask are supported");
+        for (int i = 0; i < iterations; i++)
+            BitMapImage loaded(name);
 
-    fileHeaderParser(imageSize);        // Read image size
-    fileHeaderParser(Xppm);             // Read PPM for X axis
-    fileHeaderParser(Yppm);             // Read PPM for Y axis
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / iterations * 1e3;
+    };
 
-    fileHeaderParser(clrUsed);          // Read size of color table
+    auto start = std::chrono::steady_clock::now();
 
-    if (clrUsed != 0)
-        throw std::runtime_error("Color table is not supported");
+    for (int i = 0; i < iterations; i++)
+        original.SaveQoi(qoiName);
 
-    fileHeaderParser(clrImportant);     // Number of important colors in table
+    std::chrono::duration<double> encode = std::chrono::steady_clock::now() - start;
 
-    fileHeaderParser(redMask);          // Mask for red channel
-    fileHeaderParser(greenMask);        // Mask for green chanel
-    fileHeaderParser(blueMask);         // Mask for blue channel
-    fileHeaderParser(alphaMask);        // Mask for alpha channel
+    BitMapImage decoded(qoiName);
+    size_t size = static_cast<size_t>(original.Width()) * original.Height() * 4;
 
-    fileHeaderParser(CSType);           // Color space type
+    if (memcmp(decoded.Pixels(), original.Pixels(), size) != 0) {
+        fprintf(stderr, "QOI round trip does not match\n");
+        return 1;
+    }
 
-    if (!CSType)
-        throw std::runtime_error("Custom color space is not supported");
+    struct stat bmpStat = {};
+    struct stat qoiStat = {};
+    stat(filename, &bmpStat);
+    stat(qoiName, &qoiStat);
+
+    double bmpLoad = timeLoads(filename);
+    double qoiLoad = timeLoads(qoiName);
+    printf("BMP: %10lld bytes, load %.2f ms\n", static_cast<long long>(bmpStat.st_size), bmpLoad);
+    printf("QOI: %10lld bytes, load %.2f ms, save %.2f ms\n", static_cast<long long>(qoiStat.st_size), qoiLoad,
+           encode.count() / iterations * 1e3);
+
+    // Reading the bytes QOI saves has to take longer than decoding it takes over loading BMP from page cache
+    if (qoiLoad > bmpLoad && bmpStat.st_size > qoiStat.st_size)
+        printf("QOI loads faster only from storage slower than %.0f MB/s\n",
+               (bmpStat.st_size - qoiStat.st_size) / (qoiLoad - bmpLoad) * 1e-3);
+    remove(qoiName);
+    return 0;
+}
 
-    offset += 48;      // Skip color whatever
+// Run blends listed in a file, one "background foreground x y output" per line, decoding every file only once.
+// With NUMA pool every background is handled by one node, which loads it into its own cache and blends copies of it
+static int runBatch(const char *jobsFile, size_t cacheBudget, NumaPool *numa) {
+    unique_ptr<FILE, int (*)(FILE *)> jobs(fopen(jobsFile, "r"), &fclose);
 
-    if (structSize == BMP_V5_HEADER_SIZE) {
-        offBits -= 16;
-        structSize = 108;
-        fseek(input.get(), BMP_V5_HEADER_SIZE - BMP_V4_HEADER_SIZE, SEEK_CUR);    // Skip "redundant" bytes (F in chat)
+    if (!jobs) {
+        fprintf(stderr, "Cannot open %s\n", jobsFile);
+        return 1;
     }
 
+    std::vector<unique_ptr<ImageCache>> caches;
 
-    image = unique_ptr<unsigned char[], free_deleter>(
-            static_cast<unsigned char *>(aligned_alloc(32, width * height * 4)));
+    for (unsigned int node = 0; node < (numa ? numa->Nodes() : 1); node++)
+        caches.emplace_back(new ImageCache(cacheBudget / (numa ? numa->Nodes() : 1)));
+
+    auto runJob = [](ImageCache &cache, const std::string &background, const std::string &foreground, int x, int y,
+                     const std::string &output) {
+        LatencyMetrics::Timer job(LatencyMetrics::Job);
+        auto bkg = cache.Load(background.c_str());
+        auto frg = cache.Load(foreground.c_str());
+
+        BitMapImage result(bkg->Width(), bkg->Height());
+        result.deepCopy(*bkg);
+
+        result.Blend(*frg, x, y);
+        result.Save(output.c_str());
+    };
+
+    char background[256];
+    char foreground[256];
+    char output[256];
+    int x = 0;
+    int y = 0;
+    int count = 0;
+    std::atomic<int> failed{0};
+    auto start = std::chrono::steady_clock::now();
+
+    while (fscanf(jobs.get(), "%255s %255s %d %d %255s", background, foreground, &x, &y, output) == 5) {
+        count++;
+
+        if (!numa) {
+            runJob(*caches[0], background, foreground, x, y, output);
+            continue;
+        }
 
-    fread(image.get(), sizeof(unsigned char), imageSize, input.get());
+        unsigned int node = std::hash<std::string>()(background) % numa->Nodes();
+
+        numa->Submit(node, [&, node, bkg = std::string(background), frg = std::string(foreground), x, y,
+                            out = std::string(output)]() {
+            try {
+                runJob(*caches[node], bkg, frg, x, y, out);
+            } catch (const std::exception &error) {
+                fprintf(stderr, "%s: %s\n", out.c_str(), error.what());
+                failed++;
+            }
+        });
+    }
+
+    if (numa)
+        numa->Wait();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    ImageCache::Statistics stats = {};
+
+    for (const unique_ptr<ImageCache> &cache : caches) {
+        ImageCache::Statistics nodeStats = cache->Stats();
+        stats.hits += nodeStats.hits;
+        stats.misses += nodeStats.misses;
+        stats.evictions += nodeStats.evictions;
+        stats.entries += nodeStats.entries;
+        stats.bytes += nodeStats.bytes;
+    }
+
+    printf("%d jobs in %.3f s\n", count - failed, elapsed.count());
+    printf("cache: %zu hits, %zu misses, %zu evictions, %zu entries, %zu bytes\n", stats.hits, stats.misses,
+           stats.evictions, stats.entries, stats.bytes);
+    return failed ? 1 : 0;
 }
 
-void BitMapImage::Save(const char *filename) {
-    unique_ptr<unsigned char[]> outBuffer(new unsigned char[BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE]);
-
-    auto writer = bufferWriter(outBuffer);
-
-    writer(static_cast<unsigned short>(0x4d42));      // Bitmap image signature
-    writer(fileSize);                                    // Filesize
-    writer(static_cast<unsigned int>(0));               // Reserved fields
-    writer(offBits);                                     // Offset to the beginning of the image
-    writer(structSize);                                  // Header structure size
-    writer(width);
-    writer(height);
-    writer(planes);
-    writer(bitCount);
-    writer(compression);
-    writer(imageSize);
-    writer(Xppm);
-    writer(Yppm);
-    writer(clrUsed);
-    writer(clrImportant);
-    writer(redMask);
-    writer(greenMask);
-    writer(blueMask);
-    writer(alphaMask);
-
-    writer(CSType);
-
-    writer(static_cast<unsigned long long> (0));
-    writer(static_cast<unsigned long long> (0));
-    writer(static_cast<unsigned long long> (0));
-    writer(static_cast<unsigned long long> (0));
-    writer(static_cast<unsigned long long> (0));
-    writer(static_cast<unsigned long long> (0));
-
-    unique_ptr<FILE, decltype(&fclose)> output(fopen(filename, "wb"), &fclose);
-    fwrite(outBuffer.get(), sizeof(unsigned char), BMP_V4_HEADER_SIZE + BMP_FILE_HEADER_SIZE, output.get());
-    fwrite(image.get(), sizeof(unsigned char), imageSize, output.get());
+// Parallel blending of a big picture with rows left where the main thread touched them and placed on nodes
+static int benchNuma(const NumaTopology &topology) {
+    const int rounds = 20;
+    const int width = 4096;
+    const int height = 2048;
+    BitMapImage frg(width, height);
+    BitMapImage unplaced(width, height);
+    BitMapImage placed(width, height);
+    BitMapImage check(width, height);
+    fillNoise(frg, 3);
+    fillNoise(unplaced, 5);
+    placed.deepCopy(unplaced);
+    check.deepCopy(unplaced);
+
+    NumaPool numa(topology);
+    numa.Place(placed);
+    printf("%u nodes:", numa.Nodes());
+
+    for (const std::vector<int> &cpus : topology.nodes)
+        printf(" %zu CPUs", cpus.size());
+
+    printf("\n");
+
+    auto measure = [&](const char *name, const std::function<void()> &run) {
+        run();
+        auto start = std::chrono::steady_clock::now();
+
+        for (int round = 0; round < rounds; round++)
+            run();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-26s %8.2f ms\n", name, elapsed.count() / rounds * 1e3);
+    };
+
+    measure("Blend, one thread", [&]() { check.Blend(frg, 0, 0); });
+    measure("Pool, rows not placed", [&]() { numa.Blend(unplaced, frg, 0, 0); });
+    measure("Pool, rows placed", [&]() { numa.Blend(placed, frg, 0, 0); });
+
+    size_t size = static_cast<size_t>(width) * height * 4;
+
+    if (memcmp(check.Pixels(), unplaced.Pixels(), size) != 0 || memcmp(check.Pixels(), placed.Pixels(), size) != 0) {
+        fprintf(stderr, "Banded result differs from Blend\n");
+        return 1;
+    }
+
+    return 0;
 }
 
-void BitMapImage::Blend(const BitMapImage &foreground, unsigned int x, unsigned int y) {
-    unsigned char *bkg_ptr = image.get();
-    unsigned char *frg_ptr = foreground.image.get();
-
-//
-//    const __m128i low_pixel_line_half = _mm_setr_epi8(0, 0x80, 1, 0x80, 2, 0x80, 3, 0x80, 4, 0x80, 5, 0x80, 6, 0x80, 7,
-//                                                      0x80);
-//    const __m128i high_pixel_line_half = _mm_setr_epi8(8, 0x80, 9, 0x80, 10, 0x80, 11, 0x80, 12, 0x80, 13, 0x80, 14,
-//                                                       0x80, 15, 0x80);
-//    const __m128i alpha_mask = _mm_setr_epi8(6, 0x80, 6, 0x80, 6, 0x80, 6, 0x80, 14, 0x80, 14, 0x80, 14, 0x80, 14,
-//                                             0x80);
-//    const __m128i store_low_half = _mm_setr_epi8(1, 3, 5, 0x80, 9, 11, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
-//                                                 0x80, 0x80);
-//    const __m128i store_high_half = _mm_setr_epi8(0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 3, 5, 0x80, 9, 11,
-//                                                  13, 0x80);
-
-
-
-    const __m256i zeroes = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
-                                            0, 0, 0, 0, 0, 0, 0, 0,
-                                            0, 0, 0, 0, 0, 0, 0, 0,
-                                            0, 0, 0, 0, 0, 0, 0, 0);
-
-    const __m256i alpha_mask = _mm256_setr_epi8(6,  0x80, 6,  0x80, 6,  0x80, 6,  0x80,
-                                                14, 0x80, 14, 0x80, 14, 0x80, 14, 0x80,
-                                                22, 0x80, 22, 0x80, 22, 0x80, 22, 0x80,
-                                                30, 0x80, 30, 0x80, 30, 0x80, 30, 0x80);
-
-    const __m256i store_low_half = _mm256_setr_epi8(1,    3,    5,    0x80, 9,    11,   13,   0x80,
-                                                    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
-                                                    17,   19,   21,   0x80, 25,   27,   29,   0x80,
-                                                    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80);
-
-    const __m256i store_high_half = _mm256_setr_epi8(0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
-                                                     1,    3,    5,    0x80, 9,    11,   13,   0x80,
-                                                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
-                                                     17,   19,   21,   0x80, 25,   27,   29,   0x80);
-
-    for (unsigned int ycur = 0; ycur < foreground.height; ycur++) {
-        for (unsigned int xcur = 0; xcur < foreground.width - 8; xcur += 8) {
-
-            unsigned int bkg_pos = ((y + ycur) * width + x + xcur) << 2;
-            unsigned int frg_pos = (ycur * foreground.width + xcur) << 2;
-
-//            /*
-//             *
-//             * Background: |A3|R3|G3|B3| |A2|R2|G2|B2| |A1|R1|G1|B1| |A0|R0|G0|B0|
-//             * Foreground: |A3|R3|G3|B3| |A2|R2|G2|B2| |A1|R1|G1|B1| |A0|R0|G0|B0|
-//             */
-//            __m128i bkg = _mm_load_si128(reinterpret_cast<const __m128i *>(bkg_ptr + bkg_pos));
-//            __m128i frg = _mm_load_si128(reinterpret_cast<const __m128i *>(frg_ptr + frg_pos));
-
-            __m256i bkg = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(bkg_ptr + bkg_pos));
-            __m256i frg = _mm256_lddqu_si256(reinterpret_cast<const __m256i *>(frg_ptr + frg_pos));
-
-//            __m128i bkg1 = _mm_shuffle_epi8(bkg, low_pixel_line_half);
-//            __m128i bkg2 = _mm_shuffle_epi8(bkg, high_pixel_line_half);
-
-            __m256i bkg1 = _mm256_unpacklo_epi8(bkg, zeroes);
-            __m256i bkg2 = _mm256_unpackhi_epi8(bkg, zeroes);
-
-//            __m128i frg1 = _mm_shuffle_epi8(frg, low_pixel_line_half);
-//            __m128i frg2 = _mm_shuffle_epi8(frg, high_pixel_line_half);
-
-            __m256i frg1 = _mm256_unpacklo_epi8(frg, zeroes);
-            __m256i frg2 = _mm256_unpackhi_epi8(frg, zeroes);
-
-//            /*
-//             * Diff 1: |__A1|__R1| |__G1|__B1| |__A0|__R0| |__G0|__B0|
-//             * Diff 2: |__A3|__R3| |__G3|__B3| |__A2|__R2| |__G2|__B2|
-//             */
-//
-//            __m128i diff1 = _mm_sub_epi16(frg1, bkg1);
-//            __m128i diff2 = _mm_sub_epi16(frg2, bkg2);
-
-            __m256i diff1 = _mm256_sub_epi16(frg1, bkg1);
-            __m256i diff2 = _mm256_sub_epi16(frg2, bkg2);
-
-//
-//            /*
-//             * Prepare alphas
-//             * Alpha 1: |__A1|__A1| |__A1|__A1| |__A0|__A0| |__A0|__A0|
-//             * Alpha 2: |__A3|__A3| |__A3|__A3| |__A2|__A2| |__A2|__A2|
-//             */
-//            __m128i alpha1 = _mm_shuffle_epi8(frg1, alpha_mask);
-//            __m128i alpha2 = _mm_shuffle_epi8(frg2, alpha_mask);
-
-            __m256i alpha1 = _mm256_shuffle_epi8(frg1, alpha_mask);
-            __m256i alpha2 = _mm256_shuffle_epi8(frg2, alpha_mask);
-
-//            /*
-//             * Multiply alphas
-//             */
-//
-//            diff1 = _mm_mullo_epi16(diff1, alpha1);
-//            diff2 = _mm_mullo_epi16(diff2, alpha2);
-
-            diff1 = _mm256_mullo_epi16(diff1, alpha1);
-            diff2 = _mm256_mullo_epi16(diff2, alpha2);
-
-//
-//            /*
-//             * Exctract result bytes from diffs
-//             */
-//            __m128i res1 = _mm_shuffle_epi8(diff1, store_low_half);
-//            __m128i res2 = _mm_shuffle_epi8(diff2, store_high_half);
-//            __m128i result = _mm_add_epi8(res1, res2);
-//            result = _mm_add_epi8(result, bkg);
-
-            __m256i res1 = _mm256_shuffle_epi8(diff1, store_low_half);
-            __m256i res2 = _mm256_shuffle_epi8(diff2, store_high_half);
-            __m256i result = _mm256_add_epi8(res1, res2);
-            result = _mm256_add_epi8(result, bkg);
-
-//
-//            /*
-//             * Store
-//             */
-//            _mm_store_si128(reinterpret_cast<__m128i *>(bkg_ptr + bkg_pos), result);
-            _mm256_storeu_si256(reinterpret_cast<__m256i *>(bkg_ptr + bkg_pos), result);
-
-//            unsigned char alpha = foreground.image[frg_pos + 3];
-//            unsigned char dif2 = (frg_ptr[frg_pos + 2] - bkg_ptr[bkg_pos + 2]);
-//            unsigned char dif1 = (frg_ptr[frg_pos + 1] - bkg_ptr[bkg_pos + 1]);
-//            unsigned char dif = (frg_ptr[frg_pos + 0] - bkg_ptr[bkg_pos + 0]);
-//            bkg_ptr[bkg_pos + 2] = (bkg_ptr[bkg_pos + 2]) + ((dif2 * alpha) >> 8);
-//            bkg_ptr[bkg_pos + 1] = (bkg_ptr[bkg_pos + 1]) + ((dif1 * alpha) >> 8);
-//            bkg_ptr[bkg_pos] = (bkg_ptr[bkg_pos]) + ((dif * alpha) >> 8);
-        }
+// Batch of icon blends mixed with full-frame composites, one task per job against bands stolen by idle workers
+static int benchStealing(unsigned int threads) {
+    const int jobs = 512;
+    const int rounds = 5;
+    BitMapImage icon(64, 64);
+    BitMapImage frame(1280, 720);
+    fillNoise(icon, 11);
+    fillNoise(frame, 13);
+
+    std::vector<std::unique_ptr<BitMapImage>> backgrounds;
+
+    for (int i = 0; i < jobs; i++) {
+        bool big = i % 32 == 0;
+        backgrounds.emplace_back(big ? new BitMapImage(1280, 720) : new BitMapImage(128, 128));
+        fillNoise(*backgrounds.back(), 200 + i);
     }
+
+    printf("%u threads, %d jobs, %d of them full frames\n", threads, jobs, jobs / 32);
+
+    // Latency of a job is the time from submitting the whole batch until it is done
+    auto measure = [&](const char *name, const std::function<void(std::vector<double> &)> &run) {
+        std::vector<double> latencies(jobs);
+        std::vector<double> all;
+        double total = 0;
+
+        for (int round = 0; round < rounds; round++) {
+            auto start = std::chrono::steady_clock::now();
+            run(latencies);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            total += elapsed.count();
+            all.insert(all.end(), latencies.begin(), latencies.end());
+        }
+
+        std::sort(all.begin(), all.end());
+        printf("%-16s %8.0f jobs/s, latency p50 %6.2f ms, p99 %6.2f ms, max %6.2f ms\n", name, jobs * rounds / total,
+               all[all.size() / 2] * 1e3, all[all.size() * 99 / 100] * 1e3, all.back() * 1e3);
+    };
+
+    measure("Thread pool", [&](std::vector<double> &latencies) {
+        auto start = std::chrono::steady_clock::now();
+        ThreadPool pool(threads);                                    // Destructor waits for all jobs
+
+        for (int i = 0; i < jobs; i++) {
+            pool.Submit([&, i]() {
+                backgrounds[i]->Blend(i % 32 == 0 ? frame : icon, 0, 0);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                latencies[i] = elapsed.count();
+            });
+        }
+    });
+    measure("Work stealing", [&](std::vector<double> &latencies) {
+        auto start = std::chrono::steady_clock::now();
+        WorkStealingPool pool(threads);
+
+        for (int i = 0; i < jobs; i++) {
+            pool.Submit([&, i]() {
+                pool.Blend(*backgrounds[i], i % 32 == 0 ? frame : icon, 0, 0);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                latencies[i] = elapsed.count();
+            });
+        }
+
+        pool.Wait();
+    });
+
+    return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    unique_ptr<MetricsDump> metrics;                                // Dumped once more on every return from main
+
+    if (getenv("ALPHABLEND_METRICS")) {
+        const char *interval = getenv("ALPHABLEND_METRICS_INTERVAL");
+        metrics.reset(new MetricsDump(getenv("ALPHABLEND_METRICS"), interval ? atoi(interval) : 10));
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "bench-stream"))
+        return benchStreaming();
+
+    if (argc > 1 && !strcmp(argv[1], "bench-blend"))
+        return benchBlend();
+
+    if (argc > 2 && !strcmp(argv[1], "bench-qoi"))
+        return benchQoi(argv[2]);
+
+    if (argc > 1 && !strcmp(argv[1], "watermark")) {
+        if (argc < 6) {
+            fprintf(stderr, "Usage: %s watermark <foreground> <x> <y> <output prefix> <background>...\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage frg(argv[2]);
+        Watermark watermark(frg);
+        std::atomic<int> failed{0};
+        auto start = std::chrono::steady_clock::now();
+
+        {
+            ThreadPool pool(std::thread::hardware_concurrency());    // Destructor waits for all files
+
+            for (int i = 6; i < argc; i++) {
+                pool.Submit([&, i]() {
+                    const char *name = strrchr(argv[i], '/');
+
+                    try {
+                        BitMapImage bkg(argv[i]);
+                        watermark.Apply(bkg, atoi(argv[3]), atoi(argv[4]));
+                        bkg.Save((std::string(argv[5]) + (name ? name + 1 : argv[i])).c_str());
+                    } catch (const std::exception &error) {
+                        fprintf(stderr, "%s: %s\n", argv[i], error.what());
+                        failed++;
+                    }
+                });
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%d images in %.3f s, %.1f images/s\n", argc - 6, elapsed.count(), (argc - 6) / elapsed.count());
+        return failed ? 1 : 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "bench-atlas"))
+        return benchAtlas();
+
+    if (argc > 1 && !strcmp(argv[1], "bench-sprites"))
+        return benchSprites();
+
+    if (argc > 1 && !strcmp(argv[1], "bench-watermark"))
+        return benchWatermark();
+
+    if (argc > 1 && !strcmp(argv[1], "bench-numa"))
+        return benchNuma(argc > 2 ? NumaTopology::Simulated(atoi(argv[2])) : NumaTopology::Detect());
+
+    if (argc > 1 && !strcmp(argv[1], "bench-steal"))
+        return benchStealing(argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency());
+
+    if (argc > 1 && !strcmp(argv[1], "batch")) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s batch <jobs file> [cache MB] [numa]\n", argv[0]);
+            return 1;
+        }
+
+        size_t budget = (argc > 3 ? strtoull(argv[3], nullptr, 10) : 256) << 20;
+
+        if (argc > 4 && !strcmp(argv[4], "numa")) {
+            NumaPool numa;
+            return runBatch(argv[2], budget, &numa);
+        }
+
+        return runBatch(argv[2], budget, nullptr);
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "convert")) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s convert <input> <output>\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage(argv[2]).Save(argv[3]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "tune")) {
+        size_t variant = calibrateKernels(true);
+
+        if (!saveTuning(variant)) {
+            fprintf(stderr, "Cannot save tuning to %s: %s\n", tuneFilePath().c_str(), strerror(errno));
+            return 1;
+        }
+
+        printf("Saved tuning to %s\n", tuneFilePath().c_str());
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "serve")) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s serve <socket> [threads]\n", argv[0]);
+            return 1;
+        }
+
+        BlendServer server(argv[2], argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency());
+        server.Run();
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "client")) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s client <socket> load <name> <file>\n"
+                            "       %s client <socket> unload <name>\n"
+                            "       %s client <socket> blend <name> <foreground> <x> <y> <output>\n"
+                            "       %s client <socket> shutdown\n", argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+
+        try {
+            BlendClient client(argv[2]);
+            int width = 0;
+            int height = 0;
+
+            if (!strcmp(argv[3], "load") && argc > 5) {
+                client.LoadBackground(argv[4], argv[5], width, height);
+                printf("Loaded %s: %dx%d\n", argv[4], width, height);
+            } else if (!strcmp(argv[3], "unload") && argc > 4) {
+                client.UnloadBackground(argv[4]);
+            } else if (!strcmp(argv[3], "blend") && argc > 8) {
+                BitMapImage frg(argv[5]);
+                client.QueryBackground(argv[4], width, height);
+
+                std::string prefix = "/alphablend-" + std::to_string(getpid());
+                SharedImage foreground((prefix + "-in").c_str(), frg.Width(), frg.Height());
+                SharedImage output((prefix + "-out").c_str(), width, height);
+                memcpy(foreground.Image().Pixels(), frg.Pixels(), static_cast<size_t>(frg.Width()) * frg.Height() * 4);
+
+                client.Blend(argv[4], foreground, atoi(argv[6]), atoi(argv[7]), output);
+                output.Image().Save(argv[8]);
+            } else if (!strcmp(argv[3], "shutdown")) {
+                client.Shutdown();
+            } else {
+                fprintf(stderr, "Unknown client command %s\n", argv[3]);
+                return 1;
+            }
+        } catch (const std::exception &error) {
+            fprintf(stderr, "%s\n", error.what());
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "blend")) {
+        if (argc < 7) {
+            fprintf(stderr, "Usage: %s blend <background> <foreground> <x> <y> <output> [opacity] [tint RRGGBB]\n",
+                    argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage frg(argv[3]);
+        BlendOptions options;
+
+        if (argc > 7)
+            options.opacity = atoi(argv[7]);
+
+        if (argc > 8) {
+            unsigned long tint = strtoul(argv[8], nullptr, 16);
+            options.tintRed = tint >> 16;
+            options.tintGreen = tint >> 8;
+            options.tintBlue = tint;
+        }
+
+        bkg.Blend(frg, atoi(argv[4]), atoi(argv[5]), options);
+        bkg.Save(argv[6]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "patch")) {
+        if (argc < 6) {
+            fprintf(stderr, "Usage: %s patch <background> <foreground> <x> <y> [opacity]\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage frg(argv[3]);
+        BlendOptions options;
+
+        if (argc > 6)
+            options.opacity = atoi(argv[6]);
+
+        BitMapImage::PatchFile(argv[2], frg, atoi(argv[4]), atoi(argv[5]), options);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "tile")) {
+        if (argc < 9) {
+            fprintf(stderr, "Usage: %s tile <background> <pattern> <spacing x> <spacing y> <offset x> <offset y> "
+                            "<output> [opacity]\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage pattern(argv[3]);
+        BlendOptions options;
+
+        if (argc > 9)
+            options.opacity = atoi(argv[9]);
+
+        bkg.BlendTiled(pattern, atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7]), options);
+        bkg.Save(argv[8]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "mip")) {
+        if (argc < 5) {
+            fprintf(stderr, "Usage: %s mip <input> <output prefix> <levels, e.g. 1,3,5> [weighted]\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage img(argv[2]);
+        std::vector<unsigned int> selected;
+        unsigned int deepest = 0;
+
+        for (char *level = strtok(argv[4], ","); level; level = strtok(nullptr, ",")) {
+            selected.push_back(atoi(level));
+            deepest = std::max(deepest, selected.back());
+        }
+
+        MipPyramid pyramid(img, deepest, argc > 5 && !strcmp(argv[5], "weighted"));
+
+        for (unsigned int level : selected) {
+            if (level >= pyramid.Count()) {
+                fprintf(stderr, "Level %u is below 1x1\n", level);
+                return 1;
+            }
+
+            pyramid.Level(level).Save((std::string(argv[3]) + "-" + std::to_string(level) + ".bmp").c_str());
+        }
+
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "atlas")) {
+        if (argc < 9 || (argc - 6) % 3) {
+            fprintf(stderr, "Usage: %s atlas <background> <atlas> <manifest> <output> <sprite> <x> <y> "
+                            "[<sprite> <x> <y> ...]\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        SpriteAtlas atlas(argv[3], argv[4]);
+
+        for (int i = 6; i + 2 < argc; i += 3)
+            bkg.Blend(atlas.Sprite(argv[i]), atoi(argv[i + 1]), atoi(argv[i + 2]));
+
+        bkg.Save(argv[5]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "chroma")) {
+        if (argc < 12) {
+            fprintf(stderr, "Usage: %s chroma <background> <foreground> <x> <y> <key red> <key green> <key blue> "
+                            "<tolerance> <softness> <output>\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage frg(argv[3]);
+        ChromaKey key = {static_cast<unsigned char>(atoi(argv[6])), static_cast<unsigned char>(atoi(argv[7])),
+                         static_cast<unsigned char>(atoi(argv[8])), static_cast<unsigned char>(atoi(argv[9])),
+                         static_cast<unsigned char>(atoi(argv[10]))};
+
+        bkg.BlendChromaKey(frg, key, atoi(argv[4]), atoi(argv[5]));
+        bkg.Save(argv[11]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "shadow")) {
+        if (argc < 10) {
+            fprintf(stderr, "Usage: %s shadow <background> <foreground> <x> <y> <offset x> <offset y> <radius> "
+                            "<output> [opacity]\n", argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage frg(argv[3]);
+        Color color = {0, 0, 0, static_cast<unsigned char>(argc > 10 ? atoi(argv[10]) : 160)};
+
+        bkg.BlendWithShadow(frg, atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7]), atoi(argv[8]), color);
+        bkg.Save(argv[9]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "scale")) {
+        if (argc < 9) {
+            fprintf(stderr, "Usage: %s scale <background> <foreground> <x> <y> <width> <height> <output> [box]\n",
+                    argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage frg(argv[3]);
+        Rect dstRect = {atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7])};
+
+        bkg.BlendScaled(frg, dstRect, argc > 9 && !strcmp(argv[9], "box") ? ScaleFilter::Box : ScaleFilter::Bilinear);
+        bkg.Save(argv[8]);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "rotate")) {
+        if (argc < 8) {
+            fprintf(stderr, "Usage: %s rotate <background> <foreground> <degrees> <center x> <center y> <output>\n",
+                    argv[0]);
+            return 1;
+        }
+
+        BitMapImage bkg(argv[2]);
+        BitMapImage frg(argv[3]);
+
+        AffineTransform transform = AffineTransform::Translation(atof(argv[5]), atof(argv[6])) *
+                                    AffineTransform::Rotation(atof(argv[4]) * M_PI / 180) *
+                                    AffineTransform::Translation(-frg.Width() / 2.0, -frg.Height() / 2.0);
+
+        bkg.BlendTransformed(frg, transform);
+        bkg.Save(argv[7]);
+        return 0;
+    }
+
     BitMapImage bkg("Hood.bmp");
     BitMapImage frg("Cat.bmp");
 
@@ -408,4 +958,4 @@ int main() {
     }
 
     bkg.Save("blended.bmp");
-}
\ No newline at end of file
+}